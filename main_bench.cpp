@@ -0,0 +1,277 @@
+// main_bench.cpp : Benchmarks the parser implementations on generated data
+//
+// Build: g++ -O2 -std=c++11 main_bench.cpp xmlparser.cpp -o xmlbench
+// Usage: xmlbench [MB per corpus, default 8]
+//
+// For each corpus and engine/mode it reports throughput (MB/s), nodes/s, number of allocations
+// and peak RSS growth (Linux only) during the parse.
+//
+
+#include "xmlparser.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+using namespace gnilk::xml;
+
+//
+// Allocation counting, everything in the parser goes through operator new (including the arena blocks)
+//
+static size_t allocCount = 0;
+static size_t allocBytes = 0;
+
+void *operator new(size_t sz) {
+  allocCount++;
+  allocBytes += sz;
+  void *p = malloc(sz ? sz : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+//
+// Peak RSS, the high water mark can be reset on Linux so each run is measured on its own
+//
+static long readStatusKB(const char *key) {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL) return -1;
+  char line[256];
+  long value = -1;
+  size_t keyLen = strlen(key);
+  while(fgets(line, sizeof(line), f) != NULL) {
+    if (!strncmp(line, key, keyLen)) {
+      value = atol(line + keyLen);
+      break;
+    }
+  }
+  fclose(f);
+  return value;
+#else
+  return -1;
+#endif
+}
+
+static void resetPeakRSS() {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+#endif
+}
+
+//
+// Corpus generators
+//
+struct Corpus {
+  const char *name;
+  std::string data;
+  size_t nodes;
+};
+
+static std::string genDeep(size_t size) {
+  std::string s = "<root>";
+  while(s.length() < size) {
+    for(int i=0;i<256;i++) s += "<level" + std::to_string(i) + " depth=\"" + std::to_string(i) + "\">";
+    s += "bottom";
+    for(int i=255;i>=0;i--) s += "</level" + std::to_string(i) + ">";
+  }
+  s += "</root>";
+  return s;
+}
+
+static std::string genWide(size_t size) {
+  std::string s = "<root>";
+  for(size_t i=0; s.length() < size; i++) {
+    s += "<item>" + std::to_string(i) + "</item>\n";
+  }
+  s += "</root>";
+  return s;
+}
+
+static std::string genAttributes(size_t size) {
+  std::string s = "<root>";
+  for(size_t i=0; s.length() < size; i++) {
+    s += "<record";
+    for(int a=0;a<10;a++) {
+      s += " attr" + std::to_string(a) + "=\"value_" + std::to_string(i*10+a) + "\"";
+    }
+    s += "/>\n";
+  }
+  s += "</root>";
+  return s;
+}
+
+static std::string genText(size_t size) {
+  static const char *lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. ";
+  std::string s = "<root>";
+  while(s.length() < size) {
+    s += "<paragraph>";
+    for(int i=0;i<20;i++) s += lorem;
+    s += "</paragraph>\n";
+  }
+  s += "</root>";
+  return s;
+}
+
+static std::string genComments(size_t size) {
+  std::string s = "<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<!DOCTYPE root>\n<root>";
+  for(size_t i=0; s.length() < size; i++) {
+    s += "<!-- comment number " + std::to_string(i) + " - with a few - dashes in it -->\n";
+    if ((i % 4) == 0) s += "<!DOCTYPE entry>\n";
+    s += "<entry id=\"" + std::to_string(i) + "\"/>\n";
+  }
+  s += "</root>";
+  return s;
+}
+
+class NodeCounter : public IParseEvents {
+public:
+  NodeCounter() : count(0) {}
+  virtual void StartTag(ITag *) { count++; }
+  virtual void EndTag(ITag *) {}
+  virtual void ContentTag(ITag *, const std::string &) {}
+  size_t count;
+};
+
+//
+// Engines, each parses a copy of the data, the copy is made before the clock starts
+//
+enum kEngine {
+  kParser,
+  kParserZeroCopy,
+  kParserFlat,
+  kParserLazy,
+  kParserParallel,
+  kParseStateFunc,
+  kParseStateClasses,
+};
+
+static const char *engineName(kEngine engine) {
+  switch(engine) {
+    case kParser : return "Parser";
+    case kParserZeroCopy : return "Parser (zero-copy)";
+    case kParserFlat : return "Parser (flat)";
+    case kParserLazy : return "Parser (lazy)";
+    case kParserParallel : return "Parser (parallel)";
+    case kParseStateFunc : return "ParseStateFunc";
+    case kParseStateClasses : return "ParseStateClasses";
+  }
+  return "";
+}
+
+// Returns false if the combination isn't supported
+static bool runEngine(kEngine engine, bool stream, std::string &input) {
+  int flags = stream?pfStream:pfNone;
+  switch(engine) {
+    case kParser : {
+        Parser p(std::move(input), NULL, flags);
+        delete p.getDocument();
+      }
+      return true;
+    case kParserZeroCopy : {
+        Parser p(std::move(input), NULL, flags | pfZeroCopy);
+        delete p.getDocument();
+      }
+      return true;
+    case kParserFlat :
+      if (stream) return false;
+      delete Parser::loadFlatXML(std::move(input));
+      return true;
+    case kParserLazy :
+      if (stream) return false;
+      delete Parser::loadLazyXML(std::move(input));
+      return true;
+    case kParserParallel :
+      if (stream) return false;
+      delete Parser::loadXMLParallel(std::move(input), 0, pfZeroCopy);
+      return true;
+    case kParseStateFunc : {
+        ParseStateFunc p(std::move(input), NULL, flags);
+        delete p.getDocument();
+      }
+      return true;
+    case kParseStateClasses : {
+        ParseStateClasses p(std::move(input), NULL, flags);
+        delete p.getDocument();
+      }
+      return true;
+  }
+  return false;
+}
+
+static void benchmark(Corpus &corpus, kEngine engine, bool stream, int iterations) {
+  double best = 0;
+  size_t allocs = 0;
+  size_t bytes = 0;
+  long peakKB = -1;
+
+  for(int i=0;i<iterations;i++) {
+    std::string input = corpus.data;
+    long rssBefore = readStatusKB("VmRSS:");
+    resetPeakRSS();
+    allocCount = allocBytes = 0;
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    if (!runEngine(engine, stream, input)) return;
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    if ((i == 0) || (secs < best)) best = secs;
+    allocs = allocCount;
+    bytes = allocBytes;
+    long peak = readStatusKB("VmHWM:");
+    if ((peak >= 0) && (rssBefore >= 0) && ((peak - rssBefore) > peakKB)) peakKB = peak - rssBefore;
+  }
+
+  printf("  %-20s %-7s %9.1f MB/s %11.0f nodes/s %10zu allocs %10zu KB alloc",
+    engineName(engine), stream?"stream":"DOM",
+    corpus.data.length() / (1024.0*1024.0) / best,
+    corpus.nodes / best,
+    allocs, bytes / 1024);
+  if (peakKB >= 0) {
+    printf(" %8ld KB peak RSS\n", peakKB);
+  } else {
+    printf("      n/a peak RSS\n");
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  size_t size = 8;
+  if (argc > 1) size = (size_t)atoi(argv[1]);
+  size *= 1024*1024;
+
+  Corpus corpora[] = {
+    { "deep nesting", genDeep(size), 0 },
+    { "wide siblings", genWide(size), 0 },
+    { "attribute heavy", genAttributes(size), 0 },
+    { "text heavy", genText(size), 0 },
+    { "comment/DOCTYPE heavy", genComments(size), 0 },
+  };
+  const kEngine engines[] = { kParser, kParserZeroCopy, kParserFlat, kParserLazy, kParserParallel, kParseStateFunc, kParseStateClasses };
+
+  for(size_t c=0;c<sizeof(corpora)/sizeof(corpora[0]);c++) {
+    Corpus &corpus = corpora[c];
+    NodeCounter counter;
+    Parser::streamXML(corpus.data, &counter);
+    corpus.nodes = counter.count;
+
+    printf("%s: %.1f MB, %zu nodes\n", corpus.name, corpus.data.length() / (1024.0*1024.0), corpus.nodes);
+    for(size_t e=0;e<sizeof(engines)/sizeof(engines[0]);e++) {
+      benchmark(corpus, engines[e], false, 3);
+      benchmark(corpus, engines[e], true, 3);
+    }
+  }
+	return 0;
+}
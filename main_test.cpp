@@ -4,6 +4,10 @@
 
 #include "xmlparser.h"
 #include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdio.h>
 
 using namespace gnilk::xml;
 
@@ -38,16 +42,394 @@ public:
       }
 
 };
+
+static int failures = 0;
+
+static void check(bool bOk, const char *what) {
+  printf("%s: %s\n", bOk?"OK":"FAILED", what);
+  if (!bOk) failures++;
+}
+
+// Name, attributes and content of a tag and everything below it, for comparing documents
+static void dumpTree(ITag *pTag, std::string &out) {
+  out += "<" + pTag->getName();
+  std::list<IAttribute *> &attributes = pTag->getAttributes();
+  for(std::list<IAttribute *>::iterator it = attributes.begin(); it != attributes.end(); it++) {
+    out += " " + (*it)->getName() + "=\"" + (*it)->getValue() + "\"";
+  }
+  out += ">" + pTag->getContent();
+  std::list<ITag *> &children = pTag->getChildren();
+  for(std::list<ITag *>::iterator it = children.begin(); it != children.end(); it++) {
+    dumpTree(*it, out);
+  }
+  out += "</>";
+}
+
+static std::string dumpTree(IDocument *pDoc) {
+  std::string out;
+  dumpTree(pDoc->getRoot(), out);
+  return out;
+}
+
+// Counts the events and the distinct tags handed out, closed tags are reused in stream mode
+class CountingEvents : public IParseEvents
+{
+public:
+  CountingEvents() : starts(0), ends(0) {}
+  virtual void StartTag(ITag *pTag) {
+    starts++;
+    tags.insert(pTag);
+  }
+  virtual void EndTag(ITag *) {
+    ends++;
+  }
+  virtual void ContentTag(ITag *, const std::string &) {}
+
+  int starts;
+  int ends;
+  std::set<ITag *> tags;
+};
+
+static std::string recordData(int numRecords) {
+  std::string data("<?xml version=\"1.0\"?><records>");
+  for(int i=0;i<numRecords;i++) {
+    char record[128];
+    snprintf(record, sizeof(record), "<record id=\"%d\"><name>record %d</name><value unit=\"ms\">%d &amp; more</value><empty/></record>", i, i, i * 7);
+    data += record;
+  }
+  data += "</records>";
+  return data;
+}
+
+// In zero-copy mode values and content point into the data kept by the document, names into its name table
+static void testZeroCopy() {
+  Document *pDoc = Parser::loadXML(xmldata, NULL, pfZeroCopy);
+  const std::string &source = pDoc->getSourceData();
+  const char *pBegin = source.c_str();
+  const char *pEnd = pBegin + source.length();
+  ITag *pComponent = pDoc->getRoot()->getFirstChild("component");
+  ITag *pLocale = pComponent->getFirstChild("InputLocale");
+  StringView name = pLocale->getNameView();
+  StringView content = pLocale->getContentView();
+  StringView value = pComponent->getAttributes().front()->getValueView();
+  check((name == StringView("InputLocale")) && (name.data() == pDoc->getNames().getName(((Tag *)pLocale)->getNameId()).data()), "zero-copy interned name");
+  check((content.data() >= pBegin) && ((content.data() + content.length()) <= pEnd), "zero-copy content view");
+  check((value.data() >= pBegin) && ((value.data() + value.length()) <= pEnd), "zero-copy attribute view");
+  check(value == StringView("Microsoft-Windows-International-Core-WinPE"), "zero-copy attribute value");
+  check(pLocale->getContent() == "0409:00000409", "zero-copy content");
+
+  Document *pCopy = Parser::loadXML(xmldata);
+  check(dumpTree(pCopy) == dumpTree(pDoc), "zero-copy same document");
+  delete pCopy;
+  delete pDoc;
+
+  // a reused parser hands out the arena blocks of the previous parse again
+  std::string data = recordData(1000);
+  Parser parser(NULL, pfZeroCopy);
+  std::string first = dumpTree(parser.parse(data));
+  size_t bytesFirst = parser.getDocument()->getArena().getBytesAllocated();
+  std::string second = dumpTree(parser.parse(data));
+  check((second == first) && (parser.getDocument()->getArena().getBytesAllocated() == bytesFirst), "zero-copy parser reuse");
+  delete parser.releaseDocument();
+}
+
+static void testStream() {
+  std::string data = recordData(1000);
+  CountingEvents events;
+  Parser::streamXML(data, &events);
+  check((events.starts == 4002) && (events.ends == 4002), "stream events");
+  // only the open tags are alive, the rest are back in the pool
+  check(events.tags.size() < 8, "stream tag pool");
+
+  CountingEvents zeroCopy;
+  Parser::streamXML(data, &zeroCopy, pfZeroCopy);
+  check((zeroCopy.starts == 4002) && (zeroCopy.ends == 4002), "stream events, zero-copy");
+
+  // a reused stream parser fires the same events again
+  CountingEvents reused;
+  Parser parser(&reused, pfStream);
+  parser.parse(data);
+  parser.parse(data);
+  check(reused.starts == 2 * 4002, "stream parser reuse");
+}
+
+// Pushed in chunks the document must come out as if parsed in one go, also with a BOM split between chunks
+static void testPush() {
+  std::string data = recordData(50);
+  Document *pRef = Parser::loadXML(data);
+  std::string ref = dumpTree(pRef);
+  delete pRef;
+
+  bool bSame = true;
+  for(size_t szChunk = 1; szChunk < 8; szChunk++) {
+    Parser parser(NULL);
+    for(size_t i = 0; i < data.length(); i += szChunk) {
+      parser.feed(data.c_str() + i, std::min(szChunk, data.length() - i));
+    }
+    parser.finish();
+    if (dumpTree(parser.getDocument()) != ref) bSame = false;
+    delete parser.getDocument();
+  }
+  check(bSame, "push chunks");
+
+  std::string withBOM = "\xef\xbb\xbf" + data;
+  bSame = true;
+  for(size_t szChunk = 1; szChunk < 8; szChunk++) {
+    Parser parser(NULL);
+    for(size_t i = 0; i < withBOM.length(); i += szChunk) {
+      parser.feed(withBOM.c_str() + i, std::min(szChunk, withBOM.length() - i));
+    }
+    parser.finish();
+    if (dumpTree(parser.getDocument()) != ref) bSame = false;
+    delete parser.getDocument();
+  }
+  check(bSame, "push chunks with split BOM");
+
+  Parser split(NULL);
+  split.feed("\xef\xbb", 2);
+  split.feed("\xbf<a>b", 5);
+  split.feed("</a>", 4);
+  split.finish();
+  ITag *pSplit = split.getDocument()->getRoot()->getFirstChild("a");
+  check((pSplit != NULL) && (pSplit->getContent() == "b") && (split.getDocument()->getRoot()->getChildren().size() == 1), "push BOM over two chunks");
+  delete split.getDocument();
+
+  // reset readies the parser for the next document, the previous one is kept by the caller
+  Parser parser(NULL);
+  parser.feed("<a>b</a>", 8);
+  parser.finish();
+  delete parser.releaseDocument();
+  parser.reset();
+  parser.feed("<c/>", 4);
+  parser.finish();
+  ITag *pRoot = parser.getDocument()->getRoot();
+  check((pRoot->getFirstChild("c") != NULL) && (pRoot->getFirstChild("a") == NULL), "push after reset");
+  delete parser.releaseDocument();
+}
+
+static void testEntities() {
+  std::string data("<r><i>&lt;&#65;&#x42;&amp;&quot;&apos;&gt;</i><j t=\"&amp;x &#x20AC;\"/></r>");
+  Document *pDoc = Parser::loadXML(data);
+  ITag *pRoot = pDoc->getRoot()->getFirstChild("r");
+  check(pRoot->getFirstChild("i")->getContent() == "<AB&\"'>", "entities in content");
+  check(pRoot->getFirstChild("j")->getAttributeValue("t", "") == "&x \xe2\x82\xac", "entities in attributes");
+  delete pDoc;
+
+  pDoc = Parser::loadXML(data, NULL, pfRawText);
+  check(pDoc->getRoot()->getFirstChild("r")->getFirstChild("i")->getContent() == "&lt;&#65;&#x42;&amp;&quot;&apos;&gt;", "entities kept with pfRawText");
+  delete pDoc;
+
+  pDoc = Parser::loadXML(data, NULL, pfZeroCopy);
+  check(pDoc->getRoot()->getFirstChild("r")->getFirstChild("i")->getContent() == "<AB&\"'>", "entities in zero-copy mode");
+  delete pDoc;
+}
+
+static void testUTF8() {
+  std::string valid("\xef\xbb\xbf<a n=\"\xc3\xa5\">h\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80</a>");
+  Document *pDoc = Parser::loadXML(valid, NULL, pfValidateUTF8);
+  check((pDoc != NULL) && (pDoc->getRoot()->getFirstChild("a")->getContent() == "h\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80"), "utf-8 valid");
+  delete pDoc;
+
+  check(Parser::loadXML("<a>\xc3\x28</a>", NULL, pfValidateUTF8) == NULL, "utf-8 invalid sequence");
+  check(Parser::loadXML("<a>\xc0\xaf</a>", NULL, pfValidateUTF8) == NULL, "utf-8 overlong sequence");
+
+  // sequences split between pushed chunks
+  Parser parser(NULL, pfValidateUTF8);
+  parser.feed(valid.c_str(), 3);
+  for(size_t i = 3; i < valid.length(); i++) parser.feed(valid.c_str() + i, 1);
+  parser.finish();
+  check(!parser.hasInvalidUTF8(), "utf-8 pushed byte by byte");
+  delete parser.getDocument();
+
+  Parser truncated(NULL, pfValidateUTF8);
+  truncated.feed("<a>\xe2\x82", 5);
+  truncated.finish();
+  check(truncated.hasInvalidUTF8(), "utf-8 truncated at the end");
+  delete truncated.getDocument();
+}
+
+static void testNames() {
+  std::string data("<r xmlns=\"urn:a\" xmlns:b=\"urn:b\"><b:c b:d=\"1\" e=\"2\"><f/></b:c><c/></r>");
+  Document *pDoc = Parser::loadXML(data, NULL, pfNamespaces);
+  NameTable &names = pDoc->getNames();
+  uint32_t nsA = names.find("urn:a");
+  uint32_t nsB = names.find("urn:b");
+  Tag *pRoot = ((Tag *)pDoc->getRoot())->getFirstChild(nsA, names.find("r"));
+  check(pRoot != NULL, "namespaces default namespace");
+  Tag *pC = (pRoot != NULL)?pRoot->getFirstChild(nsB, names.find("c")):NULL;
+  check((pC != NULL) && (pC->getName() == "b:c"), "namespaces prefixed tag");
+  check((pC != NULL) && (pC->getAttribute(nsB, names.find("d")) != NULL) && (pC->getAttribute(0, names.find("e")) != NULL), "namespaces attributes");
+  check((pRoot != NULL) && (pRoot->getFirstChild(nsA, names.find("c")) != NULL), "namespaces same local name");
+
+  // names are stored once, the lookup by id compares integers
+  check((pC != NULL) && (pC->getNameId() == names.find("b:c")), "interned tag name");
+  check((pRoot != NULL) && (pRoot->getFirstChild(names.find("c")) == pRoot->getFirstChild(StringView("c"))), "lookup by name id");
+  delete pDoc;
+
+  pDoc = Parser::loadXML(data);
+  check(((Tag *)pDoc->getRoot()->getFirstChild("r"))->getNamespaceId() == NAME_NONE, "namespaces not resolved without the flag");
+  delete pDoc;
+}
+
+static void testCaseSensitive() {
+  std::string data("<a><b>x</B><c/></a>");
+  Document *pDoc = Parser::loadXML(data);
+  check(DocumentWriter::toString(pDoc) == "<a><b>x</b><c/></a>", "end tag case ignored");
+  delete pDoc;
+  pDoc = Parser::loadXML(data, NULL, pfCaseSensitive);
+  check(DocumentWriter::toString(pDoc) == "<a><b>x<c/></b></a>", "end tag case with pfCaseSensitive");
+  delete pDoc;
+  FlatDocument *pFlat = Parser::loadFlatXML(data, NULL, pfCaseSensitive);
+  check(DocumentWriter::toString(pFlat) == "<a><b>x<c/></b></a>", "end tag case in flat documents");
+  delete pFlat;
+}
+
+static void testDocPath() {
+  Document *pDoc = Parser::loadXML(xmldata);
+  DocPath path;
+  check(path.compile("component[@language=neutral].SetupUILanguage.UILanguage"), "docpath compile");
+  ITag *pTag = path.findFirst(pDoc);
+  check((pTag != NULL) && (pTag->getContent() == "en-US"), "docpath find first");
+
+  std::vector<ITag *> result;
+  path.compile("component.*[.=en-US]");
+  check((path.findAll(pDoc, result) == 3) && (result[0]->getName() == "UILanguage"), "docpath find all");
+
+  check(path.compile("component[@language='other'].UILanguage") && (path.findFirst(pDoc) == NULL), "docpath no match");
+  check(!path.compile("component[@language"), "docpath malformed");
+
+  // the same compiled path evaluated from within a match
+  path.compile("*");
+  result.clear();
+  path.findAll(pDoc->getRoot()->getFirstChild("component"), result);
+  size_t nested = 0;
+  for(size_t i = 0; i < result.size(); i++) nested += (path.findFirst(result[i]) != NULL)?1:0;
+  check((result.size() == 5) && (nested == 1), "docpath reentrant");
+  delete pDoc;
+}
+
+// Writes the document, parses the output and writes it again, both outputs must match
+static void testWriterRoundTrip() {
+  std::string data("<?xml version=\"1.0\"?><?xml-stylesheet href=\"a.xsl\" type=\"text/xsl\"?><doc a=\"1\"><?pi b=\"2\"?><a>x y</a><b/></doc>");
+  Document *pDoc = Parser::loadXML(data);
+  std::string out = DocumentWriter::toString(pDoc);
+  check(out == data, "writer output");
+  check(pDoc->getRoot()->getFirstChild("xml-stylesheet")->isInstruction(), "writer instruction flag");
+
+  Document *pAgain = Parser::loadXML(out);
+  check(DocumentWriter::toString(pAgain) == out, "writer round trip");
+  check(DocumentWriter::toString(pAgain, wfPretty) == DocumentWriter::toString(pDoc, wfPretty), "writer round trip, pretty");
+  delete pAgain;
+
+  FlatDocument *pFlat = Parser::loadFlatXML(data);
+  check(DocumentWriter::toString(pFlat) == out, "writer flat document");
+  delete pFlat;
+  LazyDocument *pLazy = Parser::loadLazyXML(data);
+  check(DocumentWriter::toString(pLazy) == out, "writer lazy document");
+  delete pLazy;
+  delete pDoc;
+
+  // the writer must not recurse per level
+  std::string deep;
+  for(int i=0;i<100000;i++) deep += "<a>";
+  deep += "x";
+  for(int i=0;i<100000;i++) deep += "</a>";
+  pDoc = Parser::loadXML(deep);
+  check(DocumentWriter::toString(pDoc) == deep, "writer deep document");
+  delete pDoc;
+}
+
+static void testParallel() {
+  std::string data = recordData(20000);
+  Document *pDoc = Parser::loadXML(data);
+  std::string ref = dumpTree(pDoc);
+  delete pDoc;
+
+  pDoc = Parser::loadXMLParallel(data, 4);
+  check((pDoc != NULL) && (dumpTree(pDoc) == ref), "parallel same document");
+  delete pDoc;
+  pDoc = Parser::loadXMLParallel(data, 3, pfZeroCopy);
+  check((pDoc != NULL) && (dumpTree(pDoc) == ref), "parallel same document, zero-copy");
+  delete pDoc;
+}
+
+static void testBatch() {
+  std::vector<std::string> inputs;
+  for(int i = 0; i < 64; i++) inputs.push_back(recordData(1 + (i % 5)));
+  inputs.push_back(xmldata);
+
+  BatchParser batch(4);
+  std::vector<Document *> results;
+  batch.parse(inputs, results);
+  bool bSame = (results.size() == inputs.size());
+  for(size_t i = 0; bSame && (i < inputs.size()); i++) {
+    Document *pRef = Parser::loadXML(inputs[i]);
+    bSame = (results[i] != NULL) && (dumpTree(results[i]) == dumpTree(pRef));
+    delete pRef;
+  }
+  for(size_t i = 0; i < results.size(); i++) delete results[i];
+  check(bSame, "batch same documents");
+}
+
+// The lazy document must read like the DOM, also when mapped from a saved index
+static void testLazy() {
+  Document *pDoc = Parser::loadXML(xmldata);
+  std::string ref = DocumentWriter::toString(pDoc);
+  delete pDoc;
+
+  LazyDocument *pLazy = Parser::loadLazyXML(xmldata);
+  check(pLazy->getMaterializedCount() == 0, "lazy nothing materialized");
+  ITag *pComponent = pLazy->getRoot()->getFirstChild("component");
+  check(pComponent->getAttributeValue("language", "") == "neutral", "lazy attribute");
+  check(pComponent->getFirstChild("SystemLocale")->getContent() == "en-US", "lazy content");
+  check(pLazy->getMaterializedCount() == 1, "lazy materialized on access");
+  check(DocumentWriter::toString(pLazy) == ref, "lazy same document");
+  delete pLazy;
+
+  const char *filename = "main_test_lazy.xml";
+  const char *indexFilename = "main_test_lazy.xml.idx";
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    check(false, "lazy index, can't write test file");
+    return;
+  }
+  fwrite(xmldata.c_str(), 1, xmldata.length(), f);
+  fclose(f);
+
+  pLazy = Parser::loadLazyFile(filename);
+  check((pLazy != NULL) && pLazy->saveIndex(indexFilename), "lazy save index");
+  delete pLazy;
+  pLazy = Parser::loadIndexedFile(filename, indexFilename);
+  check((pLazy != NULL) && (DocumentWriter::toString(pLazy) == ref), "lazy indexed same document");
+  check((pLazy != NULL) && (pLazy->getRoot()->getFirstChild("component")->getAttributeValue("versionScope", "") == "nonSxS"), "lazy indexed attribute");
+  delete pLazy;
+  remove(filename);
+  remove(indexFilename);
+}
+
 int main(int argc, char* argv[])
 {
 
   ParseEventTracker events;
   Document *pDoc = Parser::loadXML(xmldata, &events);
   pDoc->dumpTagTree(pDoc->getRoot(),0);
+  delete pDoc;
 
+  testZeroCopy();
+  testStream();
+  testPush();
+  testEntities();
+  testUTF8();
+  testNames();
+  testCaseSensitive();
+  testDocPath();
+  testWriterRoundTrip();
+  testParallel();
+  testBatch();
+  testLazy();
 
-
-	return 0;
+  printf("%d failed\n", failures);
+	return (failures > 0)?1:0;
 }
 
 
@@ -10,11 +10,11 @@ Modified: $Date: $ by $Author: Fkling $
 TODO: [ -:Not done, +:In progress, !:Completed]
 <pre>
   ! Implement discard mode (i.e. just parse, don't create nodes)
-  + define a callback interface and enable it (parser can be used as a SAX parser)
+  ! define a callback interface and enable it (parser can be used as a SAX parser) -> Parser::streamXML
     [-] Add states to internal TAG node for 'start','end','content' callback's => No needed
-  - Abstract the stream handling (nextChar, peek and rewind)
+  ! Abstract the stream handling (nextChar, peek and rewind) -> ParserCore source, push parsing with Parser::feed/finish
   - Remove constant token definitions
-  - Try to UTF-8 the code (just change the std::string stuff to std::wstring and off we go...)
+  ! Try to UTF-8 the code -> the data is UTF-8 as is (no std::wstring), names and text take any sequence, pfValidateUTF8 checks the input
   ! Check if we really need to trim the strings during parsing -> we do need this (for callbacks to work)
 </pre>
 
@@ -25,6 +25,32 @@ TODO: [ -:Not done, +:In progress, !:Completed]
 
 ---------------------------------------------------------------------------*/
 #include "xmlparser.h"          
+#ifndef XML_PARSER_NO_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+#ifdef XML_PARSER_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(XML_PARSER_SIMD_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(XML_PARSER_SIMD_SSE2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#ifndef XML_PARSER_NO_MMAP
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
 
 using namespace gnilk::xml;
 
@@ -32,456 +58,3232 @@ Parser::Parser() {
     // Inherited only comes here
 }
 Parser::Parser(std::string _data) {
-  initialize(_data, NULL);
+  initialize(std::move(_data), NULL);
 }
 Parser::Parser(std::string _data, IParseEvents *pEventHandler) {
-  initialize(_data, pEventHandler);
+  initialize(std::move(_data), pEventHandler);
+}
+Parser::Parser(std::string _data, IParseEvents *pEventHandler, int flags) {
+  initialize(std::move(_data), pEventHandler, flags);
+}
+
+void Parser::initialize(std::string _data, IParseEvents *pEventHandler, int flags)
+{
+  begin(pEventHandler, flags);
+  // In zero-copy mode the tags reference the data, so the document must own it
+  if ((parseFlags & pfZeroCopy) && (pDocument != NULL)) {
+    pDocument->getSourceData().swap(_data);
+    pData = pDocument->getSourceData().c_str();
+    szData = pDocument->getSourceData().length();
+  } else {
+    data.swap(_data);
+    pData = data.c_str();
+    szData = data.length();
+  }
+  parseData();
+}
+
+// Parses data owned by someone else, must be called after 'begin'
+void Parser::parseBuffer(const char *buffer, size_t len)
+{
+  pData = buffer;
+  szData = len;
+  parseData();
+}
+
+// No data yet, it's given with 'parse' or 'feed' and 'finish'
+Parser::Parser(IParseEvents *pEventHandler, int flags) {
+  begin(pEventHandler, flags);
+  pData = data.c_str();
+  szData = 0;
 }
 
-void Parser::initialize(std::string _data, IParseEvents *pEventHandler)
+void Parser::begin(IParseEvents *pEventHandler, int flags)
 {
-#ifndef STATIC_STRING_UTIL
+#ifndef XML_PARSER_STATIC_STRING_UTIL
   sUtil = new StringUtil();
+#else
+  sUtil = NULL;
 #endif
   attrName ="";
   attrValue="";
   token = "";
 
   this->pEventHandler = pEventHandler;
-  data = _data;
-  root = new Tag("root");
-  pDocument = new Document();
+  parseFlags = requestedFlags = flags;
+  invalidUTF8 = false;
+  pNames = &streamNames;
+  nsBindings.clear();
+  szUtf8Tail = 0;
+  bomPending = true;
+  // Streaming only fires events, there is no document
+  if (parseFlags & pfStream) {
+    parseMode = pmStream;
+    pDocument = NULL;
+    root = new Tag("root");
+    tagStack.push(root);
+  } else {
+    parseMode = pmDOMBuild;
+    restart(new Document());
+  }
+  idxCurrent = 0;
+  state = oldState = psConsume;
+  pPushCore = NULL;
+  unbalanced = false;
+}
+
+// Starts over on another (empty) document, everything else is kept. Only for the DOM mode.
+void Parser::restart(Document *pDoc)
+{
+  pDocument = pDoc;
+  pNames = &pDocument->getNames();
+  nsBindings.clear();
+  root = pDocument->createTag();
+  root->setName("root");
   pDocument->setRoot(root);
+  while(!tagStack.empty()) tagStack.pop();
+  tagStack.push(root);
   idxCurrent = 0;
   state = oldState = psConsume;
-  parseMode = pmDOMBuild;
-  parseData();
+  unbalanced = false;
+}
+
+void Parser::feed(const char *chunk, size_t len)
+{
+  // views into the feed buffer would not survive the compaction between chunks
+  parseFlags &= ~pfZeroCopy;
+  if (pPushCore == NULL) {
+    pPushCore = new ParserCore<ChunkSource, Parser>(pushSource, *this);
+  }
+  if (invalidUTF8 || !validateChunk(chunk, len)) return;
+  compact();
+  data.append(chunk, len);
+  // the BOM is dropped before anything else, it can be split between chunks so nothing is parsed until it's known
+  if (bomPending) {
+    if ((data.length() < 3) && !memcmp(data.c_str(), "\xef\xbb\xbf", data.length())) return;
+    data.erase(0, XmlScan::skipBOM(data.c_str(), data.length()));
+    bomPending = false;
+  }
+  pushSource.pData = data.c_str();
+  pushSource.szData = data.length();
+  pPushCore->parse();
+}
+
+void Parser::finish()
+{
+  if (pPushCore == NULL) feed("", 0);
+  if ((parseFlags & pfValidateUTF8) && (szUtf8Tail > 0)) invalidUTF8 = true;
+  if (invalidUTF8) return;
+  // less than a BOM was fed, it's parsed as it is
+  if (bomPending) {
+    bomPending = false;
+    pushSource.pData = data.c_str();
+    pushSource.szData = data.length();
+  }
+  pushSource.bComplete = true;
+  pPushCore->parse();
+}
+
+Document *Parser::parse(const StringView &input)
+{
+  reset();
+  pData = input.data();
+  szData = input.length();
+  parseMemory(pData, szData);
+  return pDocument;
+}
+
+// Validates (with pfValidateUTF8) and parses from after the BOM
+void Parser::parseMemory(const char *buffer, size_t len)
+{
+  invalidUTF8 = ((parseFlags & pfValidateUTF8) && (XmlScan::findInvalidUTF8(buffer, 0, len) != len));
+  if (invalidUTF8) return;
+  MemorySource source(buffer, len);
+  ParserCore<MemorySource, Parser> core(source, *this);
+  core.seek(XmlScan::skipBOM(buffer, len));
+  core.parse();
+}
+
+// Pushed chunks can split a sequence, the start of it is kept until the rest arrives
+bool Parser::validateChunk(const char *chunk, size_t len)
+{
+  if (!(parseFlags & pfValidateUTF8)) return true;
+  size_t idx = 0;
+  if (szUtf8Tail > 0) {
+    size_t szSequence = XmlScan::utf8Length((unsigned char)utf8Tail[0]);
+    char sequence[4];
+    memcpy(sequence, utf8Tail, szUtf8Tail);
+    while((szUtf8Tail < szSequence) && (idx < len)) {
+      sequence[szUtf8Tail++] = chunk[idx++];
+    }
+    if (szUtf8Tail < szSequence) {
+      memcpy(utf8Tail, sequence, szUtf8Tail);
+      // all but the lead must be continuation bytes
+      for(size_t i = 1; i < szUtf8Tail; i++) {
+        if ((sequence[i] & 0xc0) != 0x80) invalidUTF8 = true;
+      }
+      return !invalidUTF8;
+    }
+    szUtf8Tail = 0;
+    if (XmlScan::findInvalidUTF8(sequence, 0, szSequence) != szSequence) {
+      invalidUTF8 = true;
+      return false;
+    }
+  }
+  size_t idxInvalid = XmlScan::findInvalidUTF8(chunk, idx, len);
+  if (idxInvalid == len) return true;
+  // a truncated sequence at the end is fine if it's all continuation bytes after the lead
+  size_t szSequence = XmlScan::utf8Length((unsigned char)chunk[idxInvalid]);
+  if ((szSequence > 1) && ((len - idxInvalid) < szSequence)) {
+    bool bPrefix = true;
+    for(size_t i = idxInvalid + 1; i < len; i++) {
+      if ((chunk[i] & 0xc0) != 0x80) bPrefix = false;
+    }
+    if (bPrefix) {
+      szUtf8Tail = len - idxInvalid;
+      memcpy(utf8Tail, chunk + idxInvalid, szUtf8Tail);
+      return true;
+    }
+  }
+  invalidUTF8 = true;
+  return false;
+}
+
+void Parser::reset()
+{
+  parseFlags = requestedFlags;
+  invalidUTF8 = false;
+  szUtf8Tail = 0;
+  bomPending = true;
+  if (parseMode == pmStream) {
+    // open tags go back to the pool, the root stays at the bottom of the stack
+    while(tagStack.top() != root) {
+      tagStack.top()->clear();
+      tagPool.push_back(tagStack.top());
+      tagStack.pop();
+    }
+    root->clear();
+    root->setName("root");
+    nsBindings.clear();
+    idxCurrent = 0;
+    state = oldState = psConsume;
+    unbalanced = false;
+  } else {
+    if (pDocument != NULL) {
+      pDocument->reset();
+      restart(pDocument);
+    } else {
+      restart(new Document());
+    }
+  }
+  if (pPushCore != NULL) {
+    data.clear();
+    pushSource.pData = data.c_str();
+    pushSource.szData = 0;
+    pushSource.bComplete = false;
+    pPushCore->reset();
+  }
+}
+
+// Drops consumed data from the feed buffer, keeps whatever the current token and attribute name refers to
+void Parser::compact()
+{
+  size_t keep = pPushCore->getKeepFrom();
+  if (keep == 0) return;
+
+  data.erase(0, keep);
+  pPushCore->shift(keep);
 }
 
 Parser::~Parser() {
-#ifndef STATIC_STRING_UTIL
+#ifndef XML_PARSER_STATIC_STRING_UTIL
     delete sUtil;
 #endif
+  delete pPushCore;
+  if (parseMode == pmStream) {
+    // unclosed tags are still on the stack, the root is at the bottom
+    while(!tagStack.empty()) {
+      if (tagStack.top() != root) delete tagStack.top();
+      tagStack.pop();
+    }
+    for(size_t i=0;i<tagPool.size();i++) {
+      delete tagPool[i];
+    }
+    delete root;
+  }
+}
+
+Document *Parser::loadXML(std::string _data, IParseEvents *pEventHandler, int flags)
+{
+  Parser p(std::move(_data), pEventHandler, flags);
+  if (p.hasInvalidUTF8()) {
+    delete p.getDocument();
+    return NULL;
+  }
+  return p.getDocument();
+}
+
+Document *Parser::loadXMLParallel(std::string _data, size_t numThreads, int flags)
+{
+  flags &= ~pfStream;
+  // checked once here, chunks start at '<' so they are valid on their own
+  if (flags & pfValidateUTF8) {
+    if (XmlScan::findInvalidUTF8(_data.c_str(), 0, _data.length()) != _data.length()) return NULL;
+    flags &= ~pfValidateUTF8;
+  }
+#ifndef XML_PARSER_NO_THREADS
+  if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+  size_t maxChunks = _data.length() / XML_PARSER_PARALLEL_MIN_CHUNK;
+  if (numThreads > maxChunks) numThreads = maxChunks;
+  // chunks would not see the prefixes bound above them
+  if (flags & pfNamespaces) numThreads = 1;
+  if (numThreads > 1) {
+    Document *pDoc = parseParallel(_data, numThreads, flags);
+    if (pDoc != NULL) return pDoc;
+  }
+#endif
+  return loadXML(std::move(_data), NULL, flags);
+}
+
+#ifndef XML_PARSER_NO_THREADS
+// '<name' followed by something ending the name
+static bool isTagStart(const char *data, size_t len, size_t idx, const StringView &name) {
+  if ((idx + 1 + name.length()) >= len) return false;
+  if ((data[idx] != '<') || memcmp(data + idx + 1, name.data(), name.length())) return false;
+  char c = data[idx + 1 + name.length()];
+  return (XmlScan::isSpace(c) || (c == '>') || (c == '/'));
+}
+
+// The '>' closing the tag starting at 'idx', attribute values are skipped
+static size_t findTagEnd(const char *data, size_t len, size_t idx) {
+  while(idx < len) {
+    if (data[idx] == '"') {
+      idx = XmlScan::findChar(data, idx + 1, len, '"');
+      if (idx >= len) break;
+    } else if (data[idx] == '>') {
+      return idx;
+    }
+    idx++;
+  }
+  return len;
+}
+
+// Skips '<?..>', '<!..>' and comments from 'idx', returns the start of the next element or tag end, 'len' if none
+static size_t findElement(const char *data, size_t len, size_t idx) {
+  while((idx = XmlScan::findChar(data, idx, len, '<')) < len) {
+    if (((idx + 3) < len) && !memcmp(data + idx, "<!--", 4)) {
+      const char *end = strstr(data + idx + 4, "-->");
+      if (end == NULL) return len;
+      idx = (end - data) + 3;
+    } else if (((idx + 1) < len) && ((data[idx+1] == '!') || (data[idx+1] == '?'))) {
+      idx = XmlScan::findChar(data, idx, len, '>');
+    } else {
+      return idx;
+    }
+  }
+  return len;
+}
+
+// Name ids of a fragment subtree are moved over to the table of the document it's stitched into
+static void remapNames(Tag *pTag, NameTable &from, NameTable &to, std::vector<uint32_t> &nameMap) {
+  uint32_t &nameId = nameMap[pTag->getNameId()];
+  if (nameId == NAME_NONE) nameId = to.intern(from.getName(pTag->getNameId()));
+  pTag->setNameId(nameId);
+  for(Attribute *attr = pTag->getFirstAttribute(); attr != NULL; attr = attr->getNext()) {
+    uint32_t &attrId = nameMap[attr->getNameId()];
+    if (attrId == NAME_NONE) attrId = to.intern(from.getName(attr->getNameId()));
+    attr->setNameId(attrId);
+  }
+  for(Tag *child = pTag->getFirstChildTag(); child != NULL; child = child->getNextSibling()) {
+    remapNames(child, from, to, nameMap);
+  }
+}
+
+// Speculative parallel parse, returns NULL without touching the data if no records are found.
+// The records below the root element are split in chunks at what looks like a record start, each chunk
+// is parsed to a separate document on a worker thread. Meanwhile this thread parses up to the first record
+// and then walks the chunks; if the parse is between tags directly below the root element and the chunk
+// was parsed without leaving its own root, the chunk is stitched in and skipped. Otherwise the
+// guess was wrong and the chunk is parsed here as usual, the result is always that of a sequential parse.
+Document *Parser::parseParallel(std::string &_data, size_t numChunks, int flags)
+{
+  const char *data = _data.c_str();
+  size_t len = _data.length();
+
+  // root element, then the first record below it
+  size_t idxRoot = findElement(data, len, 0);
+  if ((idxRoot >= len) || (data[idxRoot+1] == '/')) return NULL;
+  size_t idxRootEnd = findTagEnd(data, len, idxRoot);
+  if ((idxRootEnd >= len) || (data[idxRootEnd-1] == '/')) return NULL;
+  size_t idxFirst = findElement(data, len, idxRootEnd);
+  if ((idxFirst >= len) || (data[idxFirst+1] == '/')) return NULL;
+  size_t idxName = XmlScan::findNameEnd(data, idxFirst + 1, len);
+  StringView recordName(data + idxFirst + 1, idxName - idxFirst - 1);
+  if (recordName.empty()) return NULL;
+
+  // the last chunk ends at the last record, the rest is parsed here
+  size_t idxLast = len - 1;
+  while((idxLast > idxFirst) && !isTagStart(data, len, idxLast, recordName)) idxLast--;
+
+  std::vector<size_t> bounds;
+  bounds.push_back(idxFirst);
+  for(size_t i = 1; i < numChunks; i++) {
+    size_t idx = idxFirst + ((idxLast - idxFirst) / numChunks) * i;
+    if (idx <= bounds.back()) idx = bounds.back() + 1;
+    while((idx = XmlScan::findChar(data, idx, len, '<')) < idxLast) {
+      if (isTagStart(data, len, idx, recordName)) break;
+      idx++;
+    }
+    if (idx >= idxLast) break;
+    bounds.push_back(idx);
+  }
+  bounds.push_back(idxLast);
+  if (bounds.size() < 3) return NULL;
+
+  size_t numParsers = bounds.size() - 1;
+  std::vector<Parser *> parsers(numParsers, NULL);
+  std::vector<char> valid(numParsers, 0);
+  std::function<void(size_t)> parseChunk = [&](size_t i) {
+    Parser *p = parsers[i];
+    MemorySource source(data + bounds[i], bounds[i+1] - bounds[i]);
+    ParserCore<MemorySource, Parser> core(source, *p);
+    core.parse();
+    valid[i] = ((core.getState() == psConsume) && (p->tagStack.size() == 1) && !p->unbalanced);
+  };
+  std::vector<std::thread> workers;
+  for(size_t i = 0; i < numParsers; i++) {
+    parsers[i] = new Parser();
+    parsers[i]->begin(NULL, flags);
+    workers.push_back(std::thread(parseChunk, i));
+  }
+
+  Parser *head = new Parser();
+  head->begin(NULL, flags);
+  MemorySource source(data, idxFirst);
+  ParserCore<MemorySource, Parser> core(source, *head);
+  core.seek(XmlScan::skipBOM(data, len));
+  core.parse();
+
+  for(size_t i = 0; i < numParsers; i++) {
+    workers[i].join();
+    Document *pFragment = parsers[i]->getDocument();
+    source.szData = bounds[i+1];
+    if (valid[i] && core.isBetweenTags() && (head->tagStack.size() == 2)) {
+      // the records of the chunk are moved below the open root element
+      Tag *parent = head->tagStack.top();
+      Tag *child = ((Tag *)pFragment->getRoot())->getFirstChildTag();
+      std::vector<uint32_t> nameMap(pFragment->getNames().size(), NAME_NONE);
+      while(child != NULL) {
+        Tag *next = child->getNextSibling();
+        remapNames(child, pFragment->getNames(), head->getDocument()->getNames(), nameMap);
+        parent->addChild(child);
+        child = next;
+      }
+      head->getDocument()->adoptFragment(pFragment);
+      core.seek(bounds[i+1]);
+    } else {
+      delete pFragment;
+      core.parse();
+    }
+    delete parsers[i];
+  }
+  source.szData = len;
+  core.parse();
+
+  Document *pDoc = head->getDocument();
+  // zero-copy tags reference the data, the buffer moves along with the string
+  if (flags & pfZeroCopy) pDoc->getSourceData().swap(_data);
+  delete head;
+  return pDoc;
+}
+#endif
+
+Document *Parser::loadFile(const std::string &filename, IParseEvents *pEventHandler, int flags)
+{
+  MappedFile *pFile = new MappedFile();
+  if (!pFile->open(filename)) {
+    delete pFile;
+    return NULL;
+  }
+  Parser p;
+  p.begin(pEventHandler, flags);
+  p.parseBuffer(pFile->getData(), pFile->getSize());
+  if (p.hasInvalidUTF8()) {
+    delete p.getDocument();
+    delete pFile;
+    return NULL;
+  }
+  // tags are views into the file, keep it around
+  if ((p.getDocument() != NULL) && (flags & pfZeroCopy)) {
+    p.getDocument()->setSourceFile(pFile);
+  } else {
+    delete pFile;
+  }
+  return p.getDocument();
+}
+
+FlatDocument *Parser::loadFlatFile(const std::string &filename, IParseEvents *pEventHandler, int flags)
+{
+  MappedFile *pFile = new MappedFile();
+  if (!pFile->open(filename)) {
+    delete pFile;
+    return NULL;
+  }
+  FlatDocument *pFlat = new FlatDocument();
+  pFlat->setSourceFile(pFile);
+  MemorySource source(pFile->getData(), pFile->getSize());
+  FlatDocumentBuilder builder(pFlat, pEventHandler, flags);
+  ParserCore<MemorySource, FlatDocumentBuilder> core(source, builder);
+  core.seek(XmlScan::skipBOM(source.pData, source.szData));
+  core.parse();
+  return pFlat;
+}
+
+bool Parser::streamFile(const std::string &filename, IParseEvents *pEventHandler, int flags)
+{
+  MappedFile file;
+  if (!file.open(filename)) return false;
+  Parser p;
+  p.begin(pEventHandler, flags | pfStream);
+  p.parseBuffer(file.getData(), file.getSize());
+  return !p.hasInvalidUTF8();
+}
+
+// SAX style, only the events are fired and no tags are kept
+void Parser::streamXML(std::string _data, IParseEvents *pEventHandler, int flags)
+{
+  Parser p(std::move(_data), pEventHandler, flags | pfStream);
+}
+
+// The flat document takes over the data and is built directly by the parser core
+FlatDocument *Parser::loadFlatXML(std::string _data, IParseEvents *pEventHandler, int flags)
+{
+  FlatDocument *pFlat = new FlatDocument();
+  pFlat->getSourceData().swap(_data);
+  MemorySource source(pFlat->getSourceData().c_str(), pFlat->getSourceData().length());
+  FlatDocumentBuilder builder(pFlat, pEventHandler, flags);
+  ParserCore<MemorySource, FlatDocumentBuilder> core(source, builder);
+  core.seek(XmlScan::skipBOM(source.pData, source.szData));
+  core.parse();
+  return pFlat;
+}
+
+// Builds the structural index of a lazy document, the data must be owned by the document
+static void indexLazyDocument(LazyDocument *pLazy, const char *pData, size_t szData, int flags)
+{
+  MemorySource source(pData, szData);
+  LazyDocumentBuilder builder(pLazy, pData, szData, flags);
+  LazyDocumentBuilder::Core core(source, builder);
+  builder.setCore(&core);
+  core.seek(XmlScan::skipBOM(pData, szData));
+  core.parse();
+  builder.finish(szData);
+}
+
+LazyDocument *Parser::loadLazyXML(std::string _data, int flags)
+{
+  if ((flags & pfValidateUTF8) && (XmlScan::findInvalidUTF8(_data.c_str(), 0, _data.length()) != _data.length())) {
+    return NULL;
+  }
+  LazyDocument *pLazy = new LazyDocument(flags);
+  pLazy->getSourceData().swap(_data);
+  indexLazyDocument(pLazy, pLazy->getSourceData().c_str(), pLazy->getSourceData().length(), flags);
+  return pLazy;
+}
+
+LazyDocument *Parser::loadLazyFile(const std::string &filename, int flags)
+{
+  MappedFile *pFile = new MappedFile();
+  if (!pFile->open(filename) ||
+      ((flags & pfValidateUTF8) && (XmlScan::findInvalidUTF8(pFile->getData(), 0, pFile->getSize()) != pFile->getSize()))) {
+    delete pFile;
+    return NULL;
+  }
+  LazyDocument *pLazy = new LazyDocument(flags);
+  pLazy->setSourceFile(pFile);
+  indexLazyDocument(pLazy, pFile->getData(), pFile->getSize(), flags);
+  return pLazy;
+}
+
+LazyDocument *Parser::loadIndexedFile(const std::string &filename, const std::string &indexFilename, int flags)
+{
+  MappedFile *pFile = new MappedFile();
+  if (!pFile->open(filename)) {
+    delete pFile;
+    return NULL;
+  }
+  LazyDocument *pLazy = new LazyDocument(flags);
+  pLazy->setSourceFile(pFile);
+  if (pLazy->readIndex(indexFilename)) return pLazy;
+
+  // missing or stale index, the data is parsed and the index written for the next time
+  if ((flags & pfValidateUTF8) && (XmlScan::findInvalidUTF8(pFile->getData(), 0, pFile->getSize()) != pFile->getSize())) {
+    delete pLazy;
+    return NULL;
+  }
+  indexLazyDocument(pLazy, pFile->getData(), pFile->getSize(), flags);
+  pLazy->saveIndex(indexFilename);
+  return pLazy;
+}
+
+void Parser::rewind() {
+  idxCurrent--;
+}
+
+int Parser::nextChar() {
+  if (idxCurrent >= szData) return EOF;
+  return pData[idxCurrent++];
+}
+
+int Parser::peekNextChar() {
+  if (idxCurrent >= szData) return EOF;
+  return pData[idxCurrent];
+}
+
+void Parser::changeState(kParseState newState) {
+
+  //printf("changeState: %d -> %d\n",state, newState);
+  oldState = state;
+  state = newState;
+  enterNewState();
+}
+
+// In DOM mode the tags live in the document arena, in stream mode they are recycled by 'endTag'
+Tag *Parser::allocTag() {
+  if (parseMode == pmDOMBuild) {
+    return pDocument->createTag();
+  }
+  if (tagPool.empty()) {
+    return new Tag();
+  }
+  Tag *tag = tagPool.back();
+  tagPool.pop_back();
+  return tag;
+}
+
+Tag* Parser::createTag(std::string name) {
+  return createTag(StringView(name));
+}
+
+// Names are interned, the tag refers to the copy in the name table so each name is stored once
+Tag *Parser::createTag(const StringView &name) {
+  Tag *tag = allocTag();
+  uint32_t nameId = pNames->intern(name);
+  tag->setNameView(pNames->getName(nameId));
+  tag->setNameId(nameId);
+  return tag;
+}
+
+// Text without '&' goes as is. Otherwise it's decoded to the document arena in zero-copy DOM mode,
+// else to the scratch buffer ('bScratch' is set) which must be copied before the next call.
+StringView Parser::decodeText(const StringView &text, bool &bScratch) {
+  bScratch = false;
+  if ((parseFlags & pfRawText) || (XmlScan::findChar(text.data(), 0, text.length(), '&') == text.length())) {
+    return text;
+  }
+  if ((parseFlags & pfZeroCopy) && (parseMode == pmDOMBuild)) {
+    char *dst = (char *)pDocument->getArena().alloc(text.length());
+    return StringView(dst, XmlEscape::decode(text.data(), text.length(), dst));
+  }
+  decodeBuffer.resize(text.length());
+  decodeBuffer.resize(XmlEscape::decode(text.data(), text.length(), &decodeBuffer[0]));
+  bScratch = true;
+  return StringView(decodeBuffer);
+}
+
+void Parser::addAttribute(Tag *pTag, const StringView &name, const StringView &value) {
+  bool bScratch;
+  StringView text = decodeText(value, bScratch);
+  uint32_t nameId = pNames->intern(name);
+  Attribute *attr;
+  if ((parseFlags & pfZeroCopy) && !bScratch) {
+    attr = pTag->addAttributeView(pNames->getName(nameId), text);
+  } else {
+    // copy mode or decoded in stream mode, the attribute keeps its own copy (pooled attributes keep the memory)
+    attr = pTag->addAttributeView(pNames->getName(nameId), StringView());
+    attr->setValue(text.data(), text.length());
+  }
+  attr->setNameId(nameId);
+}
+
+void Parser::setContent(Tag *pTag, const StringView &content) {
+  bool bScratch;
+  StringView text = decodeText(content, bScratch);
+  if (!(parseFlags & pfZeroCopy)) {
+    pTag->setContent(text.data(), text.length());
+  } else if (bScratch) {
+    pTag->setContent(decodeBuffer);
+  } else {
+    pTag->setContentView(text);
+  }
+  if ((pEventHandler != NULL) && !content.empty()) {
+    pEventHandler->ContentTag((ITag *)pTag, pTag->getContent());
+  }
+}
+
+void Parser::endTag(std::string tok) {
+  endTag(StringView(tok));
+}
+
+// An end tag spelled like its start tag is a plain compare of the views, without pfCaseSensitive
+// the case is folded (ASCII only), nothing is allocated either way
+bool Parser::matchEndTag(Tag *pTag, const StringView &tok) {
+  StringView name = pTag->getNameView();
+  if (name == tok) return true;
+  if (parseFlags & pfCaseSensitive) return false;
+  return SUTIL_INVOKE(equalsIgnoreCase(name, tok));
+}
+
+void Parser::endTag(const StringView &tok) {
+  Tag *popped = NULL;
+  if (tagStack.top() == root) {
+    // more end tags than start tags, the root is never popped
+    unbalanced = true;
+  } else if (!matchEndTag(tagStack.top(), tok)) {
+    Tag *top = tagStack.top();
+    // can be an empty tag, like <br />
+    if (top->hasContent() == false) { 
+      popped = tagStack.top(); 
+      tagStack.pop();
+    } else {
+      unbalanced = true;
+#ifdef _DEBUG
+      printf("WARN: Illegal XML, end-tag has no corrsponding start tag!\n");
+#endif
+    }
+  } else {
+    if (!tagStack.empty()) {
+      popped = tagStack.top();
+      tagStack.pop();
+    }
+  }		
+
+  if (pEventHandler != NULL) {
+    pEventHandler->EndTag((ITag *)popped);
+  }
+
+  // the prefixes declared on the tag go out of scope
+  if ((popped != NULL) && (parseFlags & pfNamespaces)) {
+    nsBindings.resize(popped->getNamespaceScope());
+  }
+
+  // In the streamed mode we don't keep tag's, they go back to the pool
+  if ((parseMode == pmStream) && (popped != NULL)) {
+    popped->clear();
+    tagPool.push_back(popped);
+  }
+}
+
+void Parser::commitTag(Tag *pTag)
+{
+  if (parseFlags & pfNamespaces) resolveNamespaces(pTag);
+  // Only store in hierarchy if we are building a 'DOM' tree
+  if (parseMode == pmDOMBuild) {
+    tagStack.top()->addChild(pTag);
+  } else {
+    // parent is alive as long as the child is open
+    pTag->setParent(tagStack.top());
+  }
+  if (pEventHandler != NULL) {
+    pEventHandler->StartTag((ITag*)pTag);
+  }
+  tagStack.push(pTag);
+}
+
+static const StringView xmlPrefix("xml");
+static const StringView xmlnsPrefix("xmlns");
+static const StringView xmlNamespace("http://www.w3.org/XML/1998/namespace");
+static const StringView xmlnsNamespace("http://www.w3.org/2000/xmlns/");
+
+// Splits 'prefix:local', the prefix is empty if there is no ':'
+static void splitQName(const StringView &qname, StringView &prefix, StringView &local) {
+  const char *colon = (const char *)memchr(qname.data(), ':', qname.length());
+  if (colon == NULL) {
+    prefix = StringView();
+    local = qname;
+  } else {
+    prefix = StringView(qname.data(), colon - qname.data());
+    local = StringView(colon + 1, qname.length() - (colon - qname.data()) - 1);
+  }
+}
+
+// Binds the prefixes declared on the tag, then gives the tag and its attributes their ids.
+// Unbound prefixes resolve to no namespace with the full name as local name.
+void Parser::resolveNamespaces(Tag *pTag)
+{
+  pTag->setNamespaceScope((uint32_t)nsBindings.size());
+  for(Attribute *attr = pTag->getFirstAttribute(); attr != NULL; attr = attr->getNext()) {
+    StringView prefix, local;
+    splitQName(attr->getNameView(), prefix, local);
+    if ((prefix.empty() && (local == xmlnsPrefix)) || (prefix == xmlnsPrefix)) {
+      NsBinding binding;
+      binding.prefixId = prefix.empty()?0:pNames->intern(local);
+      binding.uriId = pNames->intern(attr->getValueView());
+      nsBindings.push_back(binding);
+    }
+  }
+
+  StringView prefix, local;
+  splitQName(pTag->getNameView(), prefix, local);
+  uint32_t nsId = lookupNamespace(prefix);
+  if (nsId == NAME_NONE) {
+    pTag->setNamespace(0, pNames->intern(pTag->getNameView()));
+  } else {
+    pTag->setNamespace(nsId, pNames->intern(local));
+  }
+
+  for(Attribute *attr = pTag->getFirstAttribute(); attr != NULL; attr = attr->getNext()) {
+    splitQName(attr->getNameView(), prefix, local);
+    if (prefix.empty()) {
+      // the default namespace doesn't apply to attributes
+      nsId = (local == xmlnsPrefix)?pNames->intern(xmlnsNamespace):0;
+    } else {
+      nsId = lookupNamespace(prefix);
+    }
+    if (nsId == NAME_NONE) {
+      attr->setNamespace(0, pNames->intern(attr->getNameView()));
+    } else {
+      attr->setNamespace(nsId, pNames->intern(local));
+    }
+  }
+}
+
+// Innermost binding of the prefix, the empty prefix is the default namespace (0 when not declared)
+uint32_t Parser::lookupNamespace(const StringView &prefix)
+{
+  if (prefix == xmlPrefix) return pNames->intern(xmlNamespace);
+  if (prefix == xmlnsPrefix) return pNames->intern(xmlnsNamespace);
+  uint32_t prefixId = prefix.empty()?0:pNames->find(prefix);
+  if (prefixId == NAME_NONE) return NAME_NONE;
+  for(size_t i = nsBindings.size(); i > 0; i--) {
+    if (nsBindings[i-1].prefixId == prefixId) return nsBindings[i-1].uriId;
+  }
+  return prefix.empty()?0:NAME_NONE;
+}
+
+void Parser::enterNewState()
+{
+  if (state == psTagContent) {
+    commitTag(tagCurrent);
+  }
+}
+
+// The state machine lives in ParserCore, we are the sink
+void Parser::parseData() {
+  parseMemory(pData, szData);
+} // parseData
+
+// -- Batch parser
+#ifndef XML_PARSER_NO_THREADS
+// Worker threads wait for a job, items are handed out through an atomic counter
+struct BatchParser::Pool {
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable cvStart;
+  std::condition_variable cvDone;
+  std::function<void(Worker &worker, size_t index)> job;
+  std::atomic<size_t> next;
+  size_t count;
+  size_t generation;
+  size_t busy;
+  bool stop;
+
+  void work(Worker &worker) {
+    size_t idx;
+    while((idx = next++) < count) {
+      job(worker, idx);
+    }
+  }
+
+  void loop(Worker *pWorker) {
+    size_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+      cvStart.wait(guard, [&]() { return stop || (generation != seen); });
+      if (stop) return;
+      seen = generation;
+      guard.unlock();
+      work(*pWorker);
+      guard.lock();
+      if (--busy == 0) cvDone.notify_one();
+    }
+  }
+};
+#else
+struct BatchParser::Pool {
+};
+#endif
+
+BatchParser::BatchParser(size_t numThreads, int flags) {
+  parseFlags = flags & ~pfStream;
+#ifndef XML_PARSER_NO_THREADS
+  if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+#endif
+  if (numThreads == 0) numThreads = 1;
+#ifdef XML_PARSER_NO_THREADS
+  numThreads = 1;
+#endif
+  workers.resize(numThreads);
+  for(size_t i = 0; i < numThreads; i++) {
+    workers[i].pParser = new Parser();
+    workers[i].pParser->begin(NULL, parseFlags);
+    workers[i].pDocument = workers[i].pParser->getDocument();
+  }
+  pPool = new Pool();
+#ifndef XML_PARSER_NO_THREADS
+  pPool->count = 0;
+  pPool->next = 0;
+  pPool->generation = 0;
+  pPool->busy = 0;
+  pPool->stop = false;
+  // the calling thread is worker 0
+  for(size_t i = 1; i < numThreads; i++) {
+    pPool->threads.push_back(std::thread(&Pool::loop, pPool, &workers[i]));
+  }
+#endif
+}
+
+BatchParser::~BatchParser() {
+#ifndef XML_PARSER_NO_THREADS
+  {
+    std::lock_guard<std::mutex> guard(pPool->lock);
+    pPool->stop = true;
+  }
+  pPool->cvStart.notify_all();
+  for(size_t i = 0; i < pPool->threads.size(); i++) {
+    pPool->threads[i].join();
+  }
+#endif
+  delete pPool;
+  for(size_t i = 0; i < workers.size(); i++) {
+    delete workers[i].pDocument;
+    delete workers[i].pParser;
+  }
+}
+
+void BatchParser::run(size_t count, std::function<void(Worker &worker, size_t index)> job) {
+#ifndef XML_PARSER_NO_THREADS
+  {
+    std::lock_guard<std::mutex> guard(pPool->lock);
+    pPool->job = job;
+    pPool->count = count;
+    pPool->next = 0;
+    pPool->busy = pPool->threads.size();
+    pPool->generation++;
+  }
+  pPool->cvStart.notify_all();
+  pPool->work(workers[0]);
+  std::unique_lock<std::mutex> guard(pPool->lock);
+  pPool->cvDone.wait(guard, [&]() { return pPool->busy == 0; });
+#else
+  for(size_t i = 0; i < count; i++) {
+    job(workers[0], i);
+  }
+#endif
+}
+
+void BatchParser::parseDocument(Worker &worker, const StringView &input, Document *pDoc, bool copyData) {
+  const char *data = input.data();
+  size_t len = input.length();
+  // zero-copy documents must own what they point to, unless they die before the input
+  if (copyData && (parseFlags & pfZeroCopy)) {
+    pDoc->getSourceData().assign(data, len);
+    data = pDoc->getSourceData().c_str();
+  }
+  worker.pParser->restart(pDoc);
+  worker.pParser->parseMemory(data, len);
+}
+
+void BatchParser::parse(const StringView *inputs, size_t count, Document **results) {
+  run(count, [&](Worker &worker, size_t i) {
+    results[i] = new Document();
+    parseDocument(worker, inputs[i], results[i], true);
+    if (worker.pParser->hasInvalidUTF8()) {
+      delete results[i];
+      results[i] = NULL;
+    }
+  });
+}
+
+void BatchParser::parse(const std::vector<std::string> &inputs, std::vector<Document *> &results) {
+  std::vector<StringView> views(inputs.begin(), inputs.end());
+  results.resize(inputs.size());
+  if (inputs.empty()) return;
+  parse(&views[0], views.size(), &results[0]);
+}
+
+void BatchParser::process(const StringView *inputs, size_t count, OnBatchDocumentDelegate onDocument) {
+  run(count, [&](Worker &worker, size_t i) {
+    worker.pDocument->reset();
+    parseDocument(worker, inputs[i], worker.pDocument, false);
+    onDocument(i, worker.pParser->hasInvalidUTF8()?NULL:worker.pDocument);
+  });
+}
+
+// -- Tag's
+Tag::Tag() {
+  parent = NULL;
+  pArena = NULL;
+  firstChild = lastChild = nextSibling = NULL;
+  firstAttribute = lastAttribute = freeAttributes = NULL;
+  attributeListValid = childListValid = false;
+  pIndex = NULL;
+  numChildren = numAttributes = 0;
+  nameId = nsId = localId = NAME_NONE;
+  nsScope = 0;
+  instruction = false;
+}
+
+Tag::Tag(std::string _name) {
+  setName(_name);
+  content.clear();
+  parent = NULL;
+  pArena = NULL;
+  firstChild = lastChild = nextSibling = NULL;
+  firstAttribute = lastAttribute = freeAttributes = NULL;
+  attributeListValid = childListValid = false;
+  pIndex = NULL;
+  numChildren = numAttributes = 0;
+  nameId = nsId = localId = NAME_NONE;
+  nsScope = 0;
+  instruction = false;
+}
+
+Tag::Tag(Arena *_pArena) {
+  parent = NULL;
+  pArena = _pArena;
+  firstChild = lastChild = nextSibling = NULL;
+  firstAttribute = lastAttribute = freeAttributes = NULL;
+  attributeListValid = childListValid = false;
+  pIndex = NULL;
+  numChildren = numAttributes = 0;
+  nameId = nsId = localId = NAME_NONE;
+  nsScope = 0;
+  instruction = false;
+}
+
+Tag::~Tag() {
+  delete pIndex;
+  // Arena allocated attributes are released by the arena
+  if (pArena != NULL) return;
+  deleteAttributes(firstAttribute);
+  deleteAttributes(freeAttributes);
+}
+
+void Tag::deleteAttributes(Attribute *attr) {
+  while(attr != NULL) {
+    Attribute *next = attr->getNext();
+    delete attr;
+    attr = next;
+  }
+}
+
+// Makes the tag ready for reuse, the attribute objects are kept for the next 'addAttribute'
+void Tag::clear() {
+  name.clear();
+  content.clear();
+  nameView = StringView();
+  contentView = StringView();
+  parent = firstChild = lastChild = nextSibling = NULL;
+  if (lastAttribute != NULL) {
+    lastAttribute->setNext(freeAttributes);
+    freeAttributes = firstAttribute;
+  }
+  firstAttribute = lastAttribute = NULL;
+  attributes.clear();
+  children.clear();
+  attributeListValid = childListValid = false;
+  numChildren = numAttributes = 0;
+  nameId = nsId = localId = NAME_NONE;
+  instruction = false;
+  // the index memory is kept, it is rebuilt on demand
+  if (pIndex != NULL) pIndex->childrenValid = pIndex->attributesValid = false;
+}
+
+Attribute *Tag::allocAttribute() {
+  if (freeAttributes != NULL) {
+    Attribute *attr = freeAttributes;
+    freeAttributes = attr->getNext();
+    attr->setNameId(NAME_NONE);
+    attr->setNamespace(NAME_NONE, NAME_NONE);
+    return attr;
+  }
+  return (pArena != NULL)?pArena->create<Attribute>():new Attribute();
+}
+
+void Tag::addAttribute(const std::string &_name, const std::string &_value) {
+  Attribute *attr = allocAttribute();
+  attr->setName(_name);
+  attr->setValue(_value);
+  //printf("AddAttr: '%s' : '%s'\n",_name.c_str(), _value.c_str());
+  linkAttribute(attr);
+}
+
+Attribute *Tag::addAttributeView(const StringView &_name, const StringView &_value) {
+  Attribute *attr = allocAttribute();
+  attr->setNameView(_name);
+  attr->setValueView(_value);
+  linkAttribute(attr);
+  return attr;
+}
+
+void Tag::linkAttribute(Attribute *attr) {
+  attr->setNext(NULL);
+  if (lastAttribute == NULL) {
+    firstAttribute = attr;
+  } else {
+    lastAttribute->setNext(attr);
+  }
+  lastAttribute = attr;
+  numAttributes++;
+  if (attributeListValid) attributes.push_back(attr);
+  if (pIndex != NULL) pIndex->attributesValid = false;
+}
+
+void Tag::addChild(Tag *tag) {
+  if (lastChild == NULL) {
+    firstChild = tag;
+  } else {
+    lastChild->nextSibling = tag;
+  }
+  lastChild = tag;
+  numChildren++;
+  if (childListValid) children.push_back(tag);
+  if (pIndex != NULL) pIndex->childrenValid = false;
+  tag->setParent(this);
+}
+
+std::list<IAttribute *> &Tag::getAttributes() {
+  if (!attributeListValid) {
+    for(Attribute *attr = firstAttribute; attr != NULL; attr = attr->getNext()) {
+      attributes.push_back(attr);
+    }
+    attributeListValid = true;
+  }
+  return attributes;
+}
+
+std::list<ITag *> &Tag::getChildren() {
+  if (!childListValid) {
+    for(Tag *child = firstChild; child != NULL; child = child->nextSibling) {
+      children.push_back(child);
+    }
+    childListValid = true;
+  }
+  return children;
+}
+
+void Tag::setParent(Tag *tag) {
+  parent = tag;
+}
+
+ITag *Tag::getParent() {
+  return parent;
+}
+
+
+bool Tag::hasContent() {
+  return (!content.empty() || !contentView.empty());
+}
+
+
+std::string Tag::toString() {
+  return std::string(getName() + " ("+getContent()+")");
+}
+
+Tag::LookupIndex *Tag::getIndex() {
+  if (pIndex == NULL) {
+    pIndex = new LookupIndex();
+    pIndex->childrenValid = pIndex->attributesValid = false;
+  }
+  return pIndex;
+}
+
+// Small tags are scanned, larger ones get an index on first lookup
+Tag *Tag::findChild(const StringView &name) {
+#ifndef XML_PARSER_NO_INDEX
+  if (numChildren >= XML_PARSER_INDEX_THRESHOLD) {
+    LookupIndex *index = getIndex();
+    if (!index->childrenValid) {
+      index->children.build(firstChild, &Tag::getNextSibling);
+      index->childrenValid = true;
+    }
+    size_t count;
+    Tag **ppChild = index->children.find(name, count);
+    return (ppChild != NULL)?ppChild[0]:NULL;
+  }
+#endif
+  for(Tag *child = firstChild; child != NULL; child = child->nextSibling) {
+    if (child->getNameView() == name) return child;
+  }
+  return NULL;
+}
+
+Attribute *Tag::findAttribute(const StringView &name) {
+#ifndef XML_PARSER_NO_INDEX
+  if (numAttributes >= XML_PARSER_INDEX_THRESHOLD) {
+    LookupIndex *index = getIndex();
+    if (!index->attributesValid) {
+      index->attributes.build(firstAttribute, &Attribute::getNext);
+      index->attributesValid = true;
+    }
+    size_t count;
+    Attribute **ppAttr = index->attributes.find(name, count);
+    return (ppAttr != NULL)?ppAttr[0]:NULL;
+  }
+#endif
+  for(Attribute *attr = firstAttribute; attr != NULL; attr = attr->getNext()) {
+    if (attr->getNameView() == name) return attr;
+  }
+  return NULL;
+}
+
+bool Tag::hasAttribute(const StringView &name) {
+  return (findAttribute(name) != NULL);
+}
+
+std::string Tag::getAttributeValue(const StringView &name, std::string defValue) {
+  Attribute *attr = findAttribute(name);
+  if (attr == NULL) return defValue;
+  return attr->getValueView().toString();
+}
+
+IAttribute *Tag::getAttribute(const StringView &name) {
+  return findAttribute(name);
+}
+
+ITag *Tag::getFirstChild(const StringView &name) {
+  return findChild(name);
+}
+
+void Tag::findChildren(const StringView &name, std::vector<ITag *> &result) {
+#ifndef XML_PARSER_NO_INDEX
+  if (numChildren >= XML_PARSER_INDEX_THRESHOLD) {
+    findChild(name);
+    size_t count;
+    Tag **ppChild = pIndex->children.find(name, count);
+    result.insert(result.end(), ppChild, ppChild + count);
+    return;
+  }
+#endif
+  for(Tag *child = firstChild; child != NULL; child = child->nextSibling) {
+    if (child->getNameView() == name) result.push_back(child);
+  }
+}
+
+static bool hasAttributeValue(Tag *tag, const StringView &attribute, const StringView &value) {
+  Attribute *attr = tag->findAttribute(attribute);
+  return ((attr != NULL) && (attr->getValueView() == value));
+}
+
+ITag *Tag::getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value) {
+#ifndef XML_PARSER_NO_INDEX
+  if (numChildren >= XML_PARSER_INDEX_THRESHOLD) {
+    // makes sure the index is built, then only visits the children with the right name
+    findChild(name);
+    size_t count;
+    Tag **ppChild = pIndex->children.find(name, count);
+    for(size_t i = 0; i < count; i++) {
+      if (hasAttributeValue(ppChild[i], attribute, value)) return ppChild[i];
+    }
+    return NULL;
+  }
+#endif
+  for(Tag *child = firstChild; child != NULL; child = child->nextSibling) {
+    if ((child->getNameView() == name) && hasAttributeValue(child, attribute, value)) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+Tag *Tag::getFirstChild(uint32_t nameId) {
+  for(Tag *child = firstChild; child != NULL; child = child->nextSibling) {
+    if (child->nameId == nameId) return child;
+  }
+  return NULL;
+}
+
+Tag *Tag::getFirstChild(uint32_t nsId, uint32_t localId) {
+  for(Tag *child = firstChild; child != NULL; child = child->nextSibling) {
+    if ((child->localId == localId) && (child->nsId == nsId)) return child;
+  }
+  return NULL;
+}
+
+Attribute *Tag::getAttribute(uint32_t nsId, uint32_t localId) {
+  for(Attribute *attr = firstAttribute; attr != NULL; attr = attr->getNext()) {
+    if ((attr->getLocalNameId() == localId) && (attr->getNamespaceId() == nsId)) return attr;
+  }
+  return NULL;
+}
+
+// -- Document container
+Document::Document() {
+  root = NULL;
+  pSourceFile = NULL;
+}
+
+Document::~Document() {
+  // The arena releases the tree
+  delete pSourceFile;
+  for(size_t i=0;i<fragments.size();i++) {
+    delete fragments[i];
+  }
+}
+
+// Drops the tree and the data, the arena keeps its blocks so the next parse has memory at hand
+void Document::reset() {
+  root = NULL;
+  arena.reset();
+  sourceData.clear();
+  delete pSourceFile;
+  pSourceFile = NULL;
+  for(size_t i=0;i<fragments.size();i++) {
+    delete fragments[i];
+  }
+  fragments.clear();
+}
+
+void Document::traverse(OnTagDelegate startHandler, OnTagDelegate endHandler) {
+  traverseNodes(startHandler, endHandler, root->getChildren());
+}
+
+void Document::traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler) {
+  traverseNodes(startHandler, endHandler, node->getChildren());
+}
+
+
+void Document::traverseNodes(OnTagDelegate startHandler, OnTagDelegate endHandler, std::list<ITag *> &tags) {
+  std::list<ITag *>::iterator it = tags.begin();
+  while(it != tags.end()) {
+    ITag *tag = *it;
+    startHandler(tag, tag->getAttributes());
+    traverseNodes(startHandler, endHandler, tag->getChildren());
+    endHandler(tag, tag->getAttributes());
+    it++;
+  }
+}
+
+std::string Document::indentString(int depth) {
+  std::string s= "";
+  for(int i=0;i<depth;i++) s+=" ";
+  return s;
+}
+
+// DEBUG HELPER!
+void Document::dumpTagTree(ITag *root, int depth) {
+  //System.out.println(indent+"T:"+root->getName());
+  printf("%*sT:%s\n", depth, "", root->getName().c_str());
+  std::list<ITag *> &tags  = root->getChildren();
+
+  std::list<ITag *>::iterator it = tags.begin();
+  while(it != tags.end()) {
+    ITag *child = *it;
+    dumpTagTree(child, depth+2);
+    it++;
+  }		
+}
+
+
+// -- Flat document
+FlatDocument::FlatDocument() {
+  pSourceFile = NULL;
+  nodes.resize(1);
+  tags.assign(1, NULL);
+  nodes[0].name = StringView("root");
+  nodes[0].parent = nodes[0].firstChild = nodes[0].nextSibling = FLAT_NONE;
+  nodes[0].firstAttribute = nodes[0].numAttributes = 0;
+  nodes[0].instruction = false;
+}
+
+FlatDocument::~FlatDocument() {
+  // facades are released by the arena
+  delete pSourceFile;
+}
+
+void FlatDocument::build(Document *pSource) {
+  // views into a mapped file stay valid when we own the mapping
+  delete pSourceFile;
+  pSourceFile = pSource->releaseSourceFile();
+
+  std::string &src = pSource->getSourceData();
+  const char *oldBase = src.c_str();
+  size_t szOld = src.length();
+  sourceData.swap(src);
+
+  nodes.clear();
+  attributes.clear();
+  flatten((Tag *)pSource->getRoot(), oldBase, szOld);
+  tags.assign(nodes.size(), NULL);
+  attributeFacades.assign(attributes.size(), NULL);
+}
+
+// Views pointing into the old buffer are moved to our copy, short strings don't keep their address on swap.
+// Anything else (decoded text in the source arena) is copied to our arena.
+StringView FlatDocument::rebase(const StringView &view, const char *oldBase, size_t szOld) {
+  if (view.empty()) return StringView();
+  if ((view.data() >= oldBase) && (view.data() < (oldBase + szOld))) {
+    return StringView(sourceData.c_str() + (view.data() - oldBase), view.length());
+  }
+  if ((pSourceFile != NULL) && (view.data() >= pSourceFile->getData()) && (view.data() < (pSourceFile->getData() + pSourceFile->getSize()))) {
+    return view;
+  }
+  char *dst = (char *)arena.alloc(view.length());
+  memcpy(dst, view.data(), view.length());
+  return StringView(dst, view.length());
+}
+
+uint32_t FlatDocument::appendNode(Tag *tag, uint32_t idxParent, const char *oldBase, size_t szOld) {
+  uint32_t idx = (uint32_t)nodes.size();
+  FlatNode node;
+  // the synthetic root has an owned name, it's always 'root'
+  node.name = (idxParent == FLAT_NONE)?StringView("root"):rebase(tag->getNameView(), oldBase, szOld);
+  node.content = rebase(tag->getContentView(), oldBase, szOld);
+  node.parent = idxParent;
+  node.firstChild = FLAT_NONE;
+  node.nextSibling = FLAT_NONE;
+  node.firstAttribute = (uint32_t)attributes.size();
+  node.numAttributes = 0;
+  node.instruction = tag->isInstruction();
+  for(Attribute *attr = tag->getFirstAttribute(); attr != NULL; attr = attr->getNext()) {
+    FlatAttribute flatAttr;
+    flatAttr.name = rebase(attr->getNameView(), oldBase, szOld);
+    flatAttr.value = rebase(attr->getValueView(), oldBase, szOld);
+    attributes.push_back(flatAttr);
+    node.numAttributes++;
+  }
+  nodes.push_back(node);
+  return idx;
+}
+
+// Nodes are appended in document order, the open tags are kept on an explicit stack so deep trees don't recurse
+struct FlattenFrame {
+  Tag *next;          // next child to flatten
+  uint32_t idx;
+  uint32_t idxLast;   // last flattened child
+  FlattenFrame(Tag *_next, uint32_t _idx) : next(_next), idx(_idx), idxLast(FLAT_NONE) {}
+};
+
+void FlatDocument::flatten(Tag *root, const char *oldBase, size_t szOld) {
+  std::vector<FlattenFrame> stack;
+  stack.push_back(FlattenFrame(root->getFirstChildTag(), appendNode(root, FLAT_NONE, oldBase, szOld)));
+  while(!stack.empty()) {
+    FlattenFrame &top = stack.back();
+    Tag *child = top.next;
+    if (child == NULL) {
+      stack.pop_back();
+      continue;
+    }
+    top.next = child->getNextSibling();
+    // don't keep references into 'nodes', it grows
+    uint32_t idxChild = appendNode(child, top.idx, oldBase, szOld);
+    if (top.idxLast == FLAT_NONE) {
+      nodes[top.idx].firstChild = idxChild;
+    } else {
+      nodes[top.idxLast].nextSibling = idxChild;
+    }
+    top.idxLast = idxChild;
+    stack.push_back(FlattenFrame(child->getFirstChildTag(), idxChild));
+  }
+}
+
+ITag *FlatDocument::getTag(uint32_t idx) {
+  if (idx >= tags.size()) return NULL;
+  if (tags[idx] == NULL) {
+    tags[idx] = arena.create<FlatTag>(this, idx);
+  }
+  return tags[idx];
+}
+
+IAttribute *FlatDocument::getAttributeFacade(uint32_t idx) {
+  if (attributeFacades[idx] == NULL) {
+    Attribute *attr = arena.create<Attribute>();
+    attr->setNameView(attributes[idx].name);
+    attr->setValueView(attributes[idx].value);
+    attributeFacades[idx] = attr;
+  }
+  return attributeFacades[idx];
+}
+
+uint32_t FlatDocument::findChild(uint32_t idxParent, const StringView &name) {
+  for(uint32_t idx = nodes[idxParent].firstChild; idx != FLAT_NONE; idx = nodes[idx].nextSibling) {
+    if (nodes[idx].name == name) return idx;
+  }
+  return FLAT_NONE;
+}
+
+const FlatAttribute *FlatDocument::findAttribute(uint32_t idxNode, const StringView &name) {
+  const FlatNode &node = nodes[idxNode];
+  for(uint32_t i = 0; i < node.numAttributes; i++) {
+    const FlatAttribute &attr = attributes[node.firstAttribute + i];
+    if (attr.name == name) return &attr;
+  }
+  return NULL;
+}
+
+void FlatDocument::traverse(OnTagDelegate startHandler, OnTagDelegate endHandler) {
+  if (nodes.empty()) return;
+  traverseNodes(startHandler, endHandler, 0);
+}
+
+void FlatDocument::traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler) {
+  traverseNodes(startHandler, endHandler, ((FlatTag *)node)->getIndex());
+}
+
+// Walks the children of 'idxParent' in document order, no recursion needed since we have parent links
+void FlatDocument::traverseNodes(OnTagDelegate startHandler, OnTagDelegate endHandler, uint32_t idxParent) {
+  uint32_t idx = nodes[idxParent].firstChild;
+  while(idx != FLAT_NONE) {
+    ITag *tag = getTag(idx);
+    startHandler(tag, tag->getAttributes());
+    if (nodes[idx].firstChild != FLAT_NONE) {
+      idx = nodes[idx].firstChild;
+      continue;
+    }
+    endHandler(tag, tag->getAttributes());
+    // walk up until we find a sibling
+    while(nodes[idx].nextSibling == FLAT_NONE) {
+      idx = nodes[idx].parent;
+      if (idx == idxParent) return;
+      tag = getTag(idx);
+      endHandler(tag, tag->getAttributes());
+    }
+    idx = nodes[idx].nextSibling;
+  }
+}
+
+// -- Flat document builder
+FlatDocumentBuilder::FlatDocumentBuilder(FlatDocument *_pDoc, IParseEvents *_pEventHandler, int flags) {
+  pDoc = _pDoc;
+  pEventHandler = _pEventHandler;
+  bCaseSensitive = (flags & pfCaseSensitive) != 0;
+  pDoc->nodes.clear();
+  pDoc->attributes.clear();
+  pDoc->tags.clear();
+  pDoc->attributeFacades.clear();
+
+  FlatNode root;
+  root.name = StringView("root");
+  root.parent = root.firstChild = root.nextSibling = FLAT_NONE;
+  root.firstAttribute = root.numAttributes = 0;
+  root.instruction = false;
+  pDoc->nodes.push_back(root);
+  pDoc->tags.push_back(NULL);
+  stack.push_back(0);
+  lastChild.push_back(FLAT_NONE);
+  idxCurrent = 0;
+}
+
+void FlatDocumentBuilder::onTagStart(const StringView &name) {
+  FlatNode node;
+  node.name = name;
+  node.parent = FLAT_NONE;
+  node.firstChild = node.nextSibling = FLAT_NONE;
+  node.firstAttribute = (uint32_t)pDoc->attributes.size();
+  node.numAttributes = 0;
+  node.instruction = false;
+  idxCurrent = (uint32_t)pDoc->nodes.size();
+  pDoc->nodes.push_back(node);
+  pDoc->tags.push_back(NULL);
+}
+
+void FlatDocumentBuilder::onInstructionStart(const StringView &name) {
+  onTagStart(name);
+  pDoc->nodes[idxCurrent].instruction = true;
+}
+
+// attributes always follow their tag so they end up as one range
+void FlatDocumentBuilder::onAttribute(const StringView &name, const StringView &value) {
+  FlatAttribute attr;
+  attr.name = name;
+  attr.value = decodeText(value);
+  pDoc->attributes.push_back(attr);
+  pDoc->attributeFacades.push_back(NULL);
+  pDoc->nodes[idxCurrent].numAttributes++;
+}
+
+bool FlatDocumentBuilder::onTagCommit() {
+  uint32_t idxParent = stack.back();
+  pDoc->nodes[idxCurrent].parent = idxParent;
+  if (lastChild.back() == FLAT_NONE) {
+    pDoc->nodes[idxParent].firstChild = idxCurrent;
+  } else {
+    pDoc->nodes[lastChild.back()].nextSibling = idxCurrent;
+  }
+  lastChild.back() = idxCurrent;
+  stack.push_back(idxCurrent);
+  lastChild.push_back(FLAT_NONE);
+  if (pEventHandler != NULL) {
+    ITag *tag = pDoc->getTag(idxCurrent);
+    pEventHandler->StartTag(tag);
+    return pEventHandler->SkipSubtree(tag);
+  }
+  return false;
+}
+
+void FlatDocumentBuilder::onContent(const StringView &content) {
+  pDoc->nodes[idxCurrent].content = decodeText(content);
+  if ((pEventHandler != NULL) && !content.empty()) {
+    ITag *tag = pDoc->getTag(idxCurrent);
+    pEventHandler->ContentTag(tag, tag->getContent());
+  }
+}
+
+// Text with entities is decoded to the document arena
+StringView FlatDocumentBuilder::decodeText(const StringView &text) {
+  if (XmlScan::findChar(text.data(), 0, text.length(), '&') == text.length()) return text;
+  char *dst = (char *)pDoc->arena.alloc(text.length());
+  return StringView(dst, XmlEscape::decode(text.data(), text.length(), dst));
+}
+
+// Same rules as Parser::endTag, a mismatching name closes a tag without content
+void FlatDocumentBuilder::onTagEnd(const StringView &name) {
+  uint32_t idxTop = stack.back();
+  bool bPop = true;
+  const StringView &top = pDoc->nodes[idxTop].name;
+  if ((top != name) && (bCaseSensitive || !StringUtilStatic::equalsIgnoreCase(top, name))) {
+    bPop = pDoc->nodes[idxTop].content.empty();
+  }
+  // never pop the root
+  if (stack.size() < 2) bPop = false;
+  if (pEventHandler != NULL) {
+    pEventHandler->EndTag(bPop?pDoc->getTag(idxTop):NULL);
+  }
+  if (bPop) {
+    stack.pop_back();
+    lastChild.pop_back();
+  }
+}
+
+// -- Flat tag facade
+FlatTag::FlatTag(FlatDocument *_pDoc, uint32_t _index) {
+  pDoc = _pDoc;
+  index = _index;
+  attributeListValid = childListValid = false;
+}
+
+const FlatNode &FlatTag::node() {
+  return pDoc->getNode(index);
+}
+
+bool FlatTag::hasContent() {
+  return !node().content.empty();
+}
+
+std::string &FlatTag::getName() {
+  if (name.empty()) name = node().name.toString();
+  return name;
+}
+
+std::string &FlatTag::getContent() {
+  if (content.empty()) content = node().content.toString();
+  return content;
+}
+
+StringView FlatTag::getNameView() {
+  return node().name;
+}
+
+StringView FlatTag::getContentView() {
+  return node().content;
+}
+
+std::string FlatTag::toString() {
+  return std::string(getName() + " ("+getContent()+")");
+}
+
+bool FlatTag::isInstruction() {
+  return node().instruction;
+}
+
+bool FlatTag::hasAttribute(const StringView &name) {
+  return (pDoc->findAttribute(index, name) != NULL);
+}
+
+std::string FlatTag::getAttributeValue(const StringView &name, std::string defValue) {
+  const FlatAttribute *attr = pDoc->findAttribute(index, name);
+  if (attr == NULL) return defValue;
+  return attr->value.toString();
+}
+
+IAttribute *FlatTag::getAttribute(const StringView &name) {
+  const FlatAttribute *attr = pDoc->findAttribute(index, name);
+  if (attr == NULL) return NULL;
+  return pDoc->getAttributeFacade((uint32_t)(attr - &pDoc->getAttribute(0)));
+}
+
+std::list<IAttribute *> &FlatTag::getAttributes() {
+  if (!attributeListValid) {
+    const FlatNode &n = node();
+    for(uint32_t i = 0; i < n.numAttributes; i++) {
+      attributes.push_back(pDoc->getAttributeFacade(n.firstAttribute + i));
+    }
+    attributeListValid = true;
+  }
+  return attributes;
+}
+
+std::list<ITag *> &FlatTag::getChildren() {
+  if (!childListValid) {
+    for(uint32_t idx = node().firstChild; idx != FLAT_NONE; idx = pDoc->getNode(idx).nextSibling) {
+      children.push_back(pDoc->getTag(idx));
+    }
+    childListValid = true;
+  }
+  return children;
+}
+
+ITag *FlatTag::getParent() {
+  uint32_t idxParent = node().parent;
+  if (idxParent == FLAT_NONE) return NULL;
+  return pDoc->getTag(idxParent);
+}
+
+ITag *FlatTag::getFirstChild(const StringView &name) {
+  uint32_t idx = pDoc->findChild(index, name);
+  if (idx == FLAT_NONE) return NULL;
+  return pDoc->getTag(idx);
+}
+
+void FlatTag::findChildren(const StringView &name, std::vector<ITag *> &result) {
+  for(uint32_t idx = node().firstChild; idx != FLAT_NONE; idx = pDoc->getNode(idx).nextSibling) {
+    if (pDoc->getNode(idx).name == name) result.push_back(pDoc->getTag(idx));
+  }
+}
+
+ITag *FlatTag::getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value) {
+  for(uint32_t idx = node().firstChild; idx != FLAT_NONE; idx = pDoc->getNode(idx).nextSibling) {
+    if (pDoc->getNode(idx).name != name) continue;
+    const FlatAttribute *attr = pDoc->findAttribute(idx, attribute);
+    if ((attr != NULL) && (attr->value == value)) {
+      return pDoc->getTag(idx);
+    }
+  }
+  return NULL;
+}
+
+// -- Lazy document
+LazyDocument::LazyDocument(int _flags) {
+  pSourceFile = NULL;
+  pIndexFile = NULL;
+  pAttributeIndex = NULL;
+  pData = "";
+  szData = 0;
+  flags = _flags;
+  numMaterialized = 0;
+  LazyNode root;
+  root.name = StringView("root");
+  root.start = root.contentStart = root.end = 0;
+  root.depth = 0;
+  root.parent = root.firstChild = root.nextSibling = FLAT_NONE;
+  nodes.push_back(root);
+}
+
+LazyDocument::~LazyDocument() {
+  // facades are released by the arena
+  delete pSourceFile;
+  delete pIndexFile;
+}
+
+ITag *LazyDocument::getTag(uint32_t idx) {
+  if (idx >= nodes.size()) return NULL;
+  // most nodes never get a facade, the table is only made when one is asked for
+  if (tags.empty()) tags.assign(nodes.size(), NULL);
+  if (tags[idx] == NULL) {
+    tags[idx] = arena.create<LazyTag>(this, idx);
+  }
+  return tags[idx];
+}
+
+uint32_t LazyDocument::findChild(uint32_t idxParent, const StringView &name) {
+  for(uint32_t idx = nodes[idxParent].firstChild; idx != FLAT_NONE; idx = nodes[idx].nextSibling) {
+    if (nodes[idx].name == name) return idx;
+  }
+  return FLAT_NONE;
+}
+
+// Parser core sink collecting the attributes of a single start tag
+struct LazyAttributeSink {
+  std::vector<FlatAttribute> &attributes;
+
+  LazyAttributeSink(std::vector<FlatAttribute> &_attributes) : attributes(_attributes) {}
+  __inline void onTagStart(const StringView &) {}
+  __inline void onInstructionStart(const StringView &) {}
+  __inline void onAttribute(const StringView &name, const StringView &value) {
+    FlatAttribute attr;
+    attr.name = name;
+    attr.value = value;
+    attributes.push_back(attr);
+  }
+  __inline bool onTagCommit() { return false; }
+  __inline void onContent(const StringView &) {}
+  __inline void onTagEnd(const StringView &) {}
+};
+
+// The attribute spans come from the index or the start tag is parsed again, on its own
+void LazyDocument::collectAttributes(uint32_t idx, std::vector<FlatAttribute> &result) {
+  result.clear();
+  if (pAttributeIndex != NULL) {
+    readIndexAttributes(idx, result);
+    return;
+  }
+  const LazyNode &node = nodes[idx];
+  MemorySource source(pData + node.start, node.contentStart - node.start);
+  LazyAttributeSink sink(result);
+  ParserCore<MemorySource, LazyAttributeSink> core(source, sink);
+  core.parse();
+}
+
+Attribute *LazyDocument::parseAttributes(uint32_t idx) {
+  collectAttributes(idx, scratch);
+  Attribute *first = NULL;
+  Attribute *last = NULL;
+  for(size_t i = 0; i < scratch.size(); i++) {
+    Attribute *attr = arena.create<Attribute>();
+    attr->setNameView(scratch[i].name);
+    attr->setValueView(decodeText(scratch[i].value));
+    if (last == NULL) first = attr; else last->setNext(attr);
+    last = attr;
+  }
+  numMaterialized++;
+  return first;
+}
+
+// Text with entities is decoded to the document arena
+StringView LazyDocument::decodeText(const StringView &text) {
+  if ((flags & pfRawText) || (XmlScan::findChar(text.data(), 0, text.length(), '&') == text.length())) return text;
+  char *dst = (char *)arena.alloc(text.length());
+  return StringView(dst, XmlEscape::decode(text.data(), text.length(), dst));
+}
+
+void LazyDocument::traverse(OnTagDelegate startHandler, OnTagDelegate endHandler) {
+  traverseNodes(startHandler, endHandler, 0);
+}
+
+void LazyDocument::traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler) {
+  traverseNodes(startHandler, endHandler, ((LazyTag *)node)->getIndex());
+}
+
+// Same walk as the flat document, the handlers get the attributes so those are materialized
+void LazyDocument::traverseNodes(OnTagDelegate startHandler, OnTagDelegate endHandler, uint32_t idxParent) {
+  uint32_t idx = nodes[idxParent].firstChild;
+  while(idx != FLAT_NONE) {
+    ITag *tag = getTag(idx);
+    startHandler(tag, tag->getAttributes());
+    if (nodes[idx].firstChild != FLAT_NONE) {
+      idx = nodes[idx].firstChild;
+      continue;
+    }
+    endHandler(tag, tag->getAttributes());
+    // walk up until we find a sibling
+    while(nodes[idx].nextSibling == FLAT_NONE) {
+      idx = nodes[idx].parent;
+      if (idx == idxParent) return;
+      tag = getTag(idx);
+      endHandler(tag, tag->getAttributes());
+    }
+    idx = nodes[idx].nextSibling;
+  }
+}
+
+// -- Lazy document index
+//
+// File layout: header, the names (length, characters), the nodes in document order and then the
+// attributes of each node. Numbers are varints, offsets are deltas to the start of the node so an
+// index is a fraction of the size of the data. The first child of a node is always the next node,
+// parents and depth follow from the links. The attributes are only decoded when a tag asks for them.
+// The header holds native integers, an index from another platform is rejected like a stale one.
+//
+#define LAZY_INDEX_VERSION (1)
+#define LAZY_INDEX_BYTE_ORDER (0x01020304)
+// the flags changing the structure, or telling what has been checked
+#define LAZY_INDEX_FLAGS (pfCaseSensitive | pfValidateUTF8)
+
+struct LazyIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t flags;
+  uint64_t dataSize;
+  uint64_t dataHash;
+  uint64_t indexSize;   // bytes following the header
+  uint64_t indexHash;
+  uint64_t attributesOffset;
+  uint32_t numNodes;
+  uint32_t numNames;
+};
+
+static const char lazyIndexMagic[4] = { 'G', 'X', 'I', 'X' };
+
+static __inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Content hash of the data, four independent lanes over 8 byte words so it runs close to memory speed
+static uint64_t contentHash(const char *data, size_t len) {
+  const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+  const uint64_t p3 = 0x165667B19E3779F9ULL;
+  uint64_t lanes[4] = { p1 + p2, p2, 0, (uint64_t)0 - p1 };
+  size_t i = 0;
+  for(; (i + 32) <= len; i += 32) {
+    for(int l = 0; l < 4; l++) {
+      uint64_t w;
+      memcpy(&w, data + i + l * 8, 8);
+      lanes[l] = rotl64(lanes[l] + w * p2, 31) * p1;
+    }
+  }
+  uint64_t h = (uint64_t)len + p3;
+  for(int l = 0; l < 4; l++) {
+    h = rotl64(h ^ lanes[l], 27) * p1 + p2;
+  }
+  for(; i < len; i++) {
+    h = rotl64(h ^ ((uint8_t)data[i] * p3), 11) * p1;
+  }
+  h ^= h >> 33;
+  h *= p2;
+  h ^= h >> 29;
+  h *= p3;
+  h ^= h >> 32;
+  return h;
+}
+
+static void putVarint(std::string &out, uint64_t v) {
+  while(v >= 0x80) {
+    out += (char)((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  out += (char)v;
+}
+
+// Reading stops at the end of the index, 'bad' is set instead
+struct VarintReader {
+  const uint8_t *ptr;
+  const uint8_t *end;
+  bool bad;
+
+  VarintReader(const char *data, size_t len) : ptr((const uint8_t *)data), end((const uint8_t *)data + len), bad(false) {}
+  __inline uint64_t get() {
+    uint64_t v = 0;
+    for(int shift = 0; (ptr < end) && (shift < 64); shift += 7) {
+      uint8_t b = *ptr++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    bad = true;
+    return 0;
+  }
+};
+
+// Written to a temporary file first, a concurrent reader never sees a partial index
+bool LazyDocument::saveIndex(const std::string &filename) {
+  NameTable names;
+  std::string nodeData;
+  std::string attributeData;
+  std::vector<FlatAttribute> spans;
+  size_t prevStart = 0;
+  for(uint32_t idx = 0; idx < nodes.size(); idx++) {
+    const LazyNode &node = nodes[idx];
+    size_t attributesStart = attributeData.length();
+    collectAttributes(idx, spans);
+    for(size_t i = 0; i < spans.size(); i++) {
+      putVarint(attributeData, names.intern(spans[i].name));
+      const char *value = spans[i].value.data();
+      if ((value >= (pData + node.start)) && ((value + spans[i].value.length()) <= (pData + node.contentStart))) {
+        putVarint(attributeData, spans[i].value.length() + 1);
+        putVarint(attributeData, (size_t)(value - pData) - node.start);
+      } else {
+        // values which aren't in the data (like '#' for 'a=#') are interned, 0 tells them apart
+        putVarint(attributeData, 0);
+        putVarint(attributeData, names.intern(spans[i].value));
+      }
+    }
+    putVarint(nodeData, node.start - prevStart);
+    putVarint(nodeData, node.contentStart - node.start);
+    putVarint(nodeData, node.end - node.contentStart);
+    putVarint(nodeData, names.intern(node.name));
+    putVarint(nodeData, node.content.length());
+    if (!node.content.empty()) putVarint(nodeData, (size_t)(node.content.data() - pData) - node.start);
+    putVarint(nodeData, (node.nextSibling == FLAT_NONE)?0:(node.nextSibling - idx));
+    putVarint(nodeData, ((attributeData.length() - attributesStart) << 1) | ((node.firstChild != FLAT_NONE)?1:0));
+    prevStart = node.start;
+  }
+
+  std::string index;
+  for(uint32_t id = 0; id < names.size(); id++) {
+    putVarint(index, names.getName(id).length());
+    index.append(names.getName(id).data(), names.getName(id).length());
+  }
+  index.append(nodeData);
+  size_t attributesOffset = index.length();
+  index.append(attributeData);
+
+  LazyIndexHeader header;
+  memcpy(header.magic, lazyIndexMagic, sizeof(header.magic));
+  header.version = LAZY_INDEX_VERSION;
+  header.byteOrder = LAZY_INDEX_BYTE_ORDER;
+  header.flags = flags & LAZY_INDEX_FLAGS;
+  header.dataSize = szData;
+  header.dataHash = contentHash(pData, szData);
+  header.indexSize = index.length();
+  header.indexHash = contentHash(index.data(), index.length());
+  header.attributesOffset = attributesOffset;
+  header.numNodes = (uint32_t)nodes.size();
+  header.numNames = (uint32_t)names.size();
+
+  std::string tmpFilename = filename + ".tmp";
+  FILE *f = fopen(tmpFilename.c_str(), "wb");
+  if (f == NULL) return false;
+  bool bOk = (fwrite(&header, sizeof(header), 1, f) == 1) && (fwrite(index.data(), 1, index.length(), f) == index.length());
+  bOk = (fclose(f) == 0) && bOk;
+  if (bOk && (rename(tmpFilename.c_str(), filename.c_str()) != 0)) {
+    // rename doesn't replace an existing file everywhere
+    remove(filename.c_str());
+    bOk = (rename(tmpFilename.c_str(), filename.c_str()) == 0);
+  }
+  if (!bOk) remove(tmpFilename.c_str());
+  return bOk;
+}
+
+// Only an index matching the data is taken. On top of the hashes everything is range checked, every
+// node must be reached exactly once through the links and links only point forward, so there are no cycles.
+bool LazyDocument::readIndex(const std::string &filename) {
+  if (pSourceFile == NULL) return false;
+  const char *data = pSourceFile->getData();
+  size_t len = pSourceFile->getSize();
+
+  MappedFile *pFile = new MappedFile();
+  if (!pFile->open(filename) || (pFile->getSize() < sizeof(LazyIndexHeader))) {
+    delete pFile;
+    return false;
+  }
+  const LazyIndexHeader *pHeader = (const LazyIndexHeader *)pFile->getData();
+  const char *index = pFile->getData() + sizeof(LazyIndexHeader);
+  size_t szIndex = pFile->getSize() - sizeof(LazyIndexHeader);
+  bool bValid = !memcmp(pHeader->magic, lazyIndexMagic, sizeof(lazyIndexMagic)) &&
+    (pHeader->version == LAZY_INDEX_VERSION) && (pHeader->byteOrder == LAZY_INDEX_BYTE_ORDER) &&
+    ((pHeader->flags & pfCaseSensitive) == (flags & pfCaseSensitive)) &&
+    (!(flags & pfValidateUTF8) || (pHeader->flags & pfValidateUTF8)) &&
+    (pHeader->dataSize == len) && (pHeader->indexSize == szIndex) && (pHeader->attributesOffset <= szIndex) &&
+    (pHeader->numNodes > 0) && (pHeader->numNames <= szIndex) && (pHeader->numNodes <= szIndex) &&
+    (contentHash(index, szIndex) == pHeader->indexHash) && (contentHash(data, len) == pHeader->dataHash);
+
+  VarintReader reader(index, bValid?(size_t)pHeader->attributesOffset:0);
+  std::vector<StringView> names(bValid?pHeader->numNames:0);
+  for(uint32_t id = 0; bValid && (id < pHeader->numNames); id++) {
+    uint64_t nameLen = reader.get();
+    bValid = !reader.bad && (nameLen <= (uint64_t)(reader.end - reader.ptr));
+    if (!bValid) break;
+    names[id] = StringView((const char *)reader.ptr, (size_t)nameLen);
+    reader.ptr += nameLen;
+  }
+
+  std::vector<LazyNode> indexNodes(bValid?pHeader->numNodes:0);
+  std::vector<size_t> offsets;
+  size_t szAttributes = bValid?(size_t)(szIndex - pHeader->attributesOffset):0;
+  if (bValid) {
+    offsets.reserve(pHeader->numNodes + 1);
+    offsets.push_back(0);
+    indexNodes[0].parent = FLAT_NONE;
+    indexNodes[0].depth = 0;
+    for(uint32_t idx = 1; idx < pHeader->numNodes; idx++) {
+      indexNodes[idx].parent = FLAT_NONE;
+    }
+  }
+  uint64_t start = 0;
+  for(uint32_t idx = 0; bValid && (idx < pHeader->numNodes); idx++) {
+    LazyNode &node = indexNodes[idx];
+    // the node must have been linked from an earlier one
+    bValid = (idx == 0) || (node.parent != FLAT_NONE);
+    start += reader.get();
+    uint64_t startTagLen = reader.get();
+    uint64_t contentLen = reader.get();
+    uint64_t nameId = reader.get();
+    uint64_t textLen = reader.get();
+    uint64_t text = (textLen > 0)?reader.get():0;
+    uint64_t nextSibling = reader.get();
+    uint64_t attributesAndChild = reader.get();
+    uint64_t szNodeAttributes = attributesAndChild >> 1;
+    bValid = bValid && !reader.bad && (start <= len) && (startTagLen <= (len - start)) &&
+      (contentLen <= (len - start - startTagLen)) && (nameId < names.size()) &&
+      (text <= (len - start)) && (textLen <= (len - start - text)) &&
+      (nextSibling < (pHeader->numNodes - idx)) && ((idx > 0) || (nextSibling == 0)) &&
+      (szNodeAttributes <= (szAttributes - offsets.back()));
+    if (!bValid) break;
+
+    node.name = names[(size_t)nameId];
+    node.content = (textLen > 0)?StringView(data + start + text, (size_t)textLen):StringView();
+    node.start = (size_t)start;
+    node.contentStart = (size_t)(start + startTagLen);
+    node.end = (size_t)(start + startTagLen + contentLen);
+    if (idx > 0) node.depth = indexNodes[node.parent].depth + 1;
+    node.nextSibling = (nextSibling == 0)?FLAT_NONE:(uint32_t)(idx + nextSibling);
+    node.firstChild = (attributesAndChild & 1)?(idx + 1):FLAT_NONE;
+    if (node.nextSibling != FLAT_NONE) {
+      bValid = (indexNodes[node.nextSibling].parent == FLAT_NONE) && (idx > 0);
+      indexNodes[node.nextSibling].parent = node.parent;
+    }
+    if (node.firstChild != FLAT_NONE) {
+      bValid = bValid && (node.firstChild < pHeader->numNodes) && (indexNodes[node.firstChild].parent == FLAT_NONE);
+      if (bValid) indexNodes[node.firstChild].parent = idx;
+    }
+
+    offsets.push_back(offsets.back() + (size_t)szNodeAttributes);
+  }
+  bValid = bValid && (reader.ptr == reader.end) && (offsets.back() == szAttributes);
+  if (!bValid) {
+    delete pFile;
+    return false;
+  }
+
+  delete pIndexFile;
+  pIndexFile = pFile;
+  pData = data;
+  szData = len;
+  nodes.swap(indexNodes);
+  indexNames.swap(names);
+  attributeOffsets.swap(offsets);
+  pAttributeIndex = index + pHeader->attributesOffset;
+  tags.clear();
+  return true;
+}
+
+// Decodes the spans of a node, a span reaching outside of the start tag ends the list
+void LazyDocument::readIndexAttributes(uint32_t idx, std::vector<FlatAttribute> &result) {
+  const LazyNode &node = nodes[idx];
+  size_t startTagLen = node.contentStart - node.start;
+  VarintReader reader(pAttributeIndex + attributeOffsets[idx], attributeOffsets[idx + 1] - attributeOffsets[idx]);
+  while(reader.ptr < reader.end) {
+    uint64_t nameId = reader.get();
+    uint64_t valueLen = reader.get();
+    uint64_t value = reader.get();
+    if (reader.bad || (nameId >= indexNames.size())) return;
+    FlatAttribute attr;
+    attr.name = indexNames[(size_t)nameId];
+    if (valueLen == 0) {
+      if (value >= indexNames.size()) return;
+      attr.value = indexNames[(size_t)value];
+    } else {
+      if ((value > startTagLen) || ((valueLen - 1) > (startTagLen - value))) return;
+      attr.value = StringView(pData + node.start + value, (size_t)(valueLen - 1));
+    }
+    result.push_back(attr);
+  }
+}
+
+// -- Lazy document builder
+LazyDocumentBuilder::LazyDocumentBuilder(LazyDocument *_pDoc, const char *pData, size_t szData, int flags) {
+  pDoc = _pDoc;
+  pDoc->pData = pData;
+  pDoc->szData = szData;
+  pCore = NULL;
+  bCaseSensitive = (flags & pfCaseSensitive) != 0;
+  pDoc->nodes.resize(1);
+  pDoc->tags.clear();
+  stack.push_back(0);
+  lastChild.push_back(FLAT_NONE);
+  idxCurrent = 0;
+}
+
+void LazyDocumentBuilder::onTagStart(const StringView &name) {
+  LazyNode node;
+  node.name = name;
+  node.start = node.contentStart = node.end = pCore->getTagStart();
+  node.depth = 0;
+  node.parent = node.firstChild = node.nextSibling = FLAT_NONE;
+  idxCurrent = (uint32_t)pDoc->nodes.size();
+  pDoc->nodes.push_back(node);
+}
+
+bool LazyDocumentBuilder::onTagCommit() {
+  uint32_t idxParent = stack.back();
+  LazyNode &node = pDoc->nodes[idxCurrent];
+  node.parent = idxParent;
+  node.depth = (uint32_t)stack.size();
+  node.contentStart = pCore->getPosition();
+  if (lastChild.back() == FLAT_NONE) {
+    pDoc->nodes[idxParent].firstChild = idxCurrent;
+  } else {
+    pDoc->nodes[lastChild.back()].nextSibling = idxCurrent;
+  }
+  lastChild.back() = idxCurrent;
+  stack.push_back(idxCurrent);
+  lastChild.push_back(FLAT_NONE);
+  return false;
+}
+
+void LazyDocumentBuilder::onContent(const StringView &content) {
+  pDoc->nodes[idxCurrent].content = content;
+}
+
+// Same rules as Parser::endTag, a mismatching name closes a tag without content
+void LazyDocumentBuilder::onTagEnd(const StringView &name) {
+  uint32_t idxTop = stack.back();
+  // never pop the root
+  if (stack.size() < 2) return;
+  LazyNode &top = pDoc->nodes[idxTop];
+  if ((top.name != name) && (bCaseSensitive || !StringUtilStatic::equalsIgnoreCase(top.name, name)) && !top.content.empty()) {
+    return;
+  }
+  top.end = pCore->getPosition();
+  stack.pop_back();
+  lastChild.pop_back();
+}
+
+void LazyDocumentBuilder::finish(size_t szData) {
+  for(size_t i = 0; i < stack.size(); i++) {
+    pDoc->nodes[stack[i]].end = szData;
+  }
+  pDoc->tags.clear();
+}
+
+// -- Lazy tag facade
+LazyTag::LazyTag(LazyDocument *_pDoc, uint32_t _index) {
+  pDoc = _pDoc;
+  index = _index;
+  firstAttribute = NULL;
+  attributesParsed = contentDecoded = attributeListValid = childListValid = false;
+}
+
+const LazyNode &LazyTag::node() {
+  return pDoc->getNode(index);
+}
+
+Attribute *LazyTag::getFirstAttribute() {
+  if (!attributesParsed) {
+    firstAttribute = pDoc->parseAttributes(index);
+    attributesParsed = true;
+  }
+  return firstAttribute;
+}
+
+Attribute *LazyTag::findAttribute(const StringView &name) {
+  for(Attribute *attr = getFirstAttribute(); attr != NULL; attr = attr->getNext()) {
+    if (attr->getNameView() == name) return attr;
+  }
+  return NULL;
+}
+
+bool LazyTag::hasContent() {
+  return !node().content.empty();
+}
+
+std::string &LazyTag::getName() {
+  if (name.empty()) name = node().name.toString();
+  return name;
+}
+
+std::string &LazyTag::getContent() {
+  if (content.empty()) content = getContentView().toString();
+  return content;
+}
+
+StringView LazyTag::getNameView() {
+  return node().name;
+}
+
+StringView LazyTag::getContentView() {
+  if (!contentDecoded) {
+    contentView = pDoc->decodeText(node().content);
+    contentDecoded = true;
+  }
+  return contentView;
+}
+
+std::string LazyTag::toString() {
+  return std::string(getName() + " ("+getContent()+")");
+}
+
+// the start offset is kept in the index as well, the tag is '<?name' in the data
+bool LazyTag::isInstruction() {
+  return (index != 0) && (pDoc->getData()[node().start + 1] == '?');
+}
+
+bool LazyTag::hasAttribute(const StringView &name) {
+  return (findAttribute(name) != NULL);
+}
+
+std::string LazyTag::getAttributeValue(const StringView &name, std::string defValue) {
+  Attribute *attr = findAttribute(name);
+  if (attr == NULL) return defValue;
+  return attr->getValueView().toString();
 }
 
-Document *Parser::loadXML(std::string _data, IParseEvents *pEventHandler)
-{
-  Parser p(_data, pEventHandler);
-  return p.getDocument();
+IAttribute *LazyTag::getAttribute(const StringView &name) {
+  return findAttribute(name);
 }
 
-void Parser::rewind() {
-  idxCurrent--;
+std::list<IAttribute *> &LazyTag::getAttributes() {
+  if (!attributeListValid) {
+    for(Attribute *attr = getFirstAttribute(); attr != NULL; attr = attr->getNext()) {
+      attributes.push_back(attr);
+    }
+    attributeListValid = true;
+  }
+  return attributes;
 }
 
-int Parser::nextChar() {
-  if (idxCurrent >= (int)data.length()) return EOF;
-  return data.at(idxCurrent++);
+std::list<ITag *> &LazyTag::getChildren() {
+  if (!childListValid) {
+    for(uint32_t idx = node().firstChild; idx != FLAT_NONE; idx = pDoc->getNode(idx).nextSibling) {
+      children.push_back(pDoc->getTag(idx));
+    }
+    childListValid = true;
+  }
+  return children;
 }
 
-int Parser::peekNextChar() {
-  if (idxCurrent >= (int)data.length()) return EOF;
-  return data.at(idxCurrent);
+ITag *LazyTag::getParent() {
+  uint32_t idxParent = node().parent;
+  if (idxParent == FLAT_NONE) return NULL;
+  return pDoc->getTag(idxParent);
 }
 
-void Parser::changeState(kParseState newState) {
+ITag *LazyTag::getFirstChild(const StringView &name) {
+  uint32_t idx = pDoc->findChild(index, name);
+  if (idx == FLAT_NONE) return NULL;
+  return pDoc->getTag(idx);
+}
 
-  //printf("changeState: %d -> %d\n",state, newState);
-  oldState = state;
-  state = newState;
-  enterNewState();
+void LazyTag::findChildren(const StringView &name, std::vector<ITag *> &result) {
+  for(uint32_t idx = node().firstChild; idx != FLAT_NONE; idx = pDoc->getNode(idx).nextSibling) {
+    if (pDoc->getNode(idx).name == name) result.push_back(pDoc->getTag(idx));
+  }
 }
 
-Tag* Parser::createTag(std::string name) {
-  Tag *tag = new Tag(name);
-  return tag;
+// Only the children with the right name get their attributes parsed
+ITag *LazyTag::getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value) {
+  for(uint32_t idx = node().firstChild; idx != FLAT_NONE; idx = pDoc->getNode(idx).nextSibling) {
+    if (pDoc->getNode(idx).name != name) continue;
+    IAttribute *attr = pDoc->getTag(idx)->getAttribute(attribute);
+    if ((attr != NULL) && (attr->getValueView() == value)) {
+      return pDoc->getTag(idx);
+    }
+  }
+  return NULL;
 }
 
-void Parser::endTag(std::string tok) {
-  Tag *popped = NULL;
-  if (!SUTIL_INVOKE(equalsIgnoreCase(tagStack.top()->getName(), tok))) {
-    Tag *top = tagStack.top();
-    // can be an empty tag, like <br />
-    if (top->hasContent() == false) { 
-      popped = tagStack.top(); 
-      tagStack.pop();
-    } else {
-#ifdef _DEBUG
-      printf("WARN: Illegal XML, end-tag has no corrsponding start tag!\n");
-#endif
+DocPath::DocPath() {
+  pathSeparator = DOCPATH_DEFAULT_SEPARATOR;
+  valid = false;
+}
+
+DocPath::DocPath(std::string separator) {
+  pathSeparator = separator;
+  valid = false;
+}
+
+bool DocPath::compile(const std::string &path) {
+  steps.clear();
+  valid = false;
+  if (path.empty() || pathSeparator.empty()) return false;
+
+  // split on the separator, but not inside predicates
+  size_t start = 0;
+  size_t i = 0;
+  int depth = 0;
+  char quote = 0;
+  while(i <= path.length()) {
+    if (i == path.length() || ((depth == 0) && !path.compare(i, pathSeparator.length(), pathSeparator))) {
+      Step step;
+      if (!compileStep(path.substr(start, i - start), step)) return false;
+      steps.push_back(step);
+      if (i == path.length()) break;
+      i += pathSeparator.length();
+      start = i;
+      continue;
     }
-  } else {
-    if (!tagStack.empty()) {
-      popped = tagStack.top();
-      tagStack.pop();
+    char c = path[i];
+    if (quote != 0) {
+      if (c == quote) quote = 0;
+    } else if ((depth > 0) && ((c == '\'') || (c == '"'))) {
+      quote = c;
+    } else if (c == '[') {
+      depth++;
+    } else if (c == ']') {
+      depth--;
+    }
+    i++;
+  }
+  valid = true;
+  return true;
+}
+
+// name[@attr][@attr=value][.=value]
+bool DocPath::compileStep(const std::string &text, Step &step) {
+  size_t pos = text.find('[');
+  step.name = text.substr(0, pos);
+  if (step.name.empty()) return false;
+  step.wildcard = (step.name == "*");
+
+  while(pos != std::string::npos) {
+    if (text[pos] != '[') return false;
+    pos++;
+    Predicate pred;
+    pred.hasValue = false;
+    if (!text.compare(pos, 2, ".=")) {
+      pred.content = true;
+      pos++;
+    } else if ((pos < text.length()) && (text[pos] == '@')) {
+      pred.content = false;
+      size_t end = text.find_first_of("=]", ++pos);
+      if (end == std::string::npos) return false;
+      pred.name = text.substr(pos, end - pos);
+      if (pred.name.empty()) return false;
+      pos = end;
+    } else {
+      return false;
     }
-  }		
 
-  if (pEventHandler != NULL) {
-    pEventHandler->EndTag((ITag *)popped);
+    if (text[pos] == '=') {
+      pred.hasValue = true;
+      pos++;
+      if ((pos < text.length()) && ((text[pos] == '\'') || (text[pos] == '"'))) {
+        size_t end = text.find(text[pos], pos + 1);
+        if (end == std::string::npos) return false;
+        pred.value = text.substr(pos + 1, end - pos - 1);
+        pos = end + 1;
+      } else {
+        size_t end = text.find(']', pos);
+        if (end == std::string::npos) return false;
+        pred.value = text.substr(pos, end - pos);
+        pos = end;
+      }
+    }
+    if ((pos >= text.length()) || (text[pos] != ']')) return false;
+    step.predicates.push_back(pred);
+    pos++;
+    if (pos == text.length()) break;
   }
+  return true;
+}
 
-  // In the streamed mode we don't keep tag's
-  if ((parseMode == pmStream) && (popped != NULL)) {
-    delete popped;
+bool DocPath::matches(ITag *tag, const Step &step, bool checkContent) {
+  for(size_t i = 0; i < step.predicates.size(); i++) {
+    const Predicate &pred = step.predicates[i];
+    if (pred.content) {
+      if (!checkContent) continue;
+      if (tag->getContentView() != StringView(pred.value)) return false;
+      continue;
+    }
+    IAttribute *attr = tag->getAttribute(pred.name);
+    if (attr == NULL) return false;
+    if (pred.hasValue && (attr->getValueView() != StringView(pred.value))) return false;
   }
+  return true;
 }
 
-void Parser::commitTag(Tag *pTag)
-{
-  if (pEventHandler != NULL) {
-    pEventHandler->StartTag((ITag*)pTag);
+// Depth first, returns true when the first match is found and that's all we want
+bool DocPath::evaluate(ITag *node, size_t idxStep, Candidates &candidates, std::vector<ITag *> *pResult, ITag **ppFirst) {
+  const Step &step = steps[idxStep];
+  std::vector<ITag *> &children = candidates[idxStep];
+  children.clear();
+  if (step.wildcard) {
+    std::list<ITag *> &all = node->getChildren();
+    children.assign(all.begin(), all.end());
+  } else {
+    node->findChildren(step.name, children);
   }
-  // Only store in hierarchy if we are building a 'DOM' tree
-  if (parseMode == pmDOMBuild) {
-    tagStack.top()->addChild(pTag);
+
+  bool last = ((idxStep + 1) == steps.size());
+  for(size_t i = 0; i < children.size(); i++) {
+    ITag *child = children[i];
+    if (!matches(child, step)) continue;
+    if (!last) {
+      if (evaluate(child, idxStep + 1, candidates, pResult, ppFirst)) return true;
+    } else if (pResult != NULL) {
+      pResult->push_back(child);
+    } else {
+      *ppFirst = child;
+      return true;
+    }
   }
-  tagStack.push(pTag);
+  return false;
 }
 
-void Parser::enterNewState()
-{
-  if (state == psTagContent) {
-    commitTag(tagCurrent);
-  }
+ITag *DocPath::findFirst(ITag *from) {
+  ITag *first = NULL;
+  if (!valid || (from == NULL)) return NULL;
+  // candidate children per step
+  Candidates candidates(steps.size());
+  evaluate(from, 0, candidates, NULL, &first);
+  return first;
 }
 
-void Parser::parseData() {
-  char c;
-  std::string attrName = "";
-  std::string attrValue = "";
-  std::string token = "";
-  tagStack.push(root);
-  while((c=nextChar())!=EOF) {
-    switch(state) 
-    {
-    case psConsume:
-      if (c=='<') {
-        int next = peekNextChar();
-        if (next == '/') {		// ? '</' - distinguish between token <  and </
-          nextChar(); // consume '/'
-          changeState(psEndTagStart);
-        } else if (next == '!') {
-          // Action tag started <!--
-          nextChar();
-          token = ""; // Reset token
-          changeState(psCommentStart);
-        } else if (next == '?') {
-          // Header tag started '<?xml
-          nextChar();
-          token = "";
-          changeState(psTagHeader);
-        } else {
-          changeState(psTagStart);
-        }
-        token="";
-      } else {
-        token+=c;
-      }
-      break;
-    case psCommentStart : // Make sure we hit '--'
-      if ((c == '-') && (peekNextChar()=='-')) {
-        nextChar();
-        changeState(psCommentConsume);
-      } else if ((c == 'D') && (peekNextChar()=='O')) {
-        changeState(psDocType);
-      } else {
-//#ifdef _DEBUG
-        printf("Warning: Illegal start of tag, expected start of comment ('<!--') but found found '<!-'\n");
-//#endif
-        // TODO: If strict, abort here!
-        rewind();   // rewind '-'
-        rewind();   // rewind '!'
-        changeState(psTagStart);
-      }
-      break;
-    case psCommentConsume:  // parse until -->
-      if ((c=='-') && (peekNextChar()=='>')) {
-        if (token == "-") {
-          nextChar();
-          changeState(psConsume);
-        }
-      } else if (c=='-') {
-        token="-";  // Store this in order to track -->
-      }
-      break;
-    case psTagHeader : // <? 
-      if (isspace(c)) {
-        // drop them
-        tagCurrent = createTag(SUTIL_INVOKE(trim(token)));
-        token = "";
-        changeState(psTagAttributeName);				
-      } else {
-        token+=c;
-      }				
-      break;
-    case psTagStart :	// from psConsume when finding: '<'          
-      if (isspace(c)) {					          
-        tagCurrent = createTag(SUTIL_INVOKE(trim(token)));
-        token = "";          
-        changeState(psTagAttributeName);
-      } else if (c=='/' && peekNextChar()=='>') {   // catch tags like '<tag/>'
-        nextChar(); // consume '>'
-        tagCurrent = createTag(SUTIL_INVOKE(trim(token)));
-        token = "";
-        commitTag(tagCurrent);
-        changeState(psConsume);
-      } else if (c=='>') {
-        tagCurrent = createTag(SUTIL_INVOKE(trim(token)));
-        token = "";
-        changeState(psTagContent);
-      } else {
-        token+=c;
-      }				
-      break;
-    case psEndTagStart : // from psConsume when finding: </
-      if (isspace(c)) {
-        // drop them
-      } else if (c=='>') {
-        // trim and terminate token
-        std::string tmptok(SUTIL_INVOKE(trim(token)));
-        endTag(tmptok);
-        // clear token and consume more data
-        token = "";			
-        changeState(psConsume);
-      } else {
-        token+=c;
-      }				
-      break;
-    case psTagAttributeName : // from psTagStart when finding white-space, from psTagHeader (<?) when finding white-space
-      if (isspace(c)) continue;
-      if ((c == '=') && (peekNextChar() == '"')) {
-        nextChar(); // consume "
-        attrName = token;
-        token = "";
-        changeState(psTagAttributeValue);
-      } else if ((c == '=') && (peekNextChar() == '#')) {
-        nextChar(); // consume #
-        attrName = token;
-        attrValue = "#";
-        tagCurrent->addAttribute(attrName,  attrValue);
-        token = "";					
-      } else if (c=='>') {	// End of tag
-        token="";
-        changeState(psTagContent);
-      } else if ((c=='/') && (peekNextChar()=='>')) {
-        nextChar();
-        commitTag(tagCurrent);
-        endTag(SUTIL_INVOKE(trim(token)));
-        token="";
-        changeState(psConsume);
-      } else if ((c=='?') && (peekNextChar()=='>')) {
-        nextChar();
-        commitTag(tagCurrent);
-        endTag(SUTIL_INVOKE(trim(token)));
-        token="";
-        changeState(psConsume);          
-      } else { 
-        token += c;
-      }
-      break;
-    case psTagAttributeValue : // from psTagAttributeName after '='
-      if (c=='"') {
-        attrValue = token;
-        tagCurrent->addAttribute(attrName, attrValue);
-        changeState(psTagAttributeName);
-        token = "";         
-      } else {
-        token +=c;
-      }
-      break;
-    case psTagContent:
-      if (c == '<') {	// can't use 'peekNext' since we might have >< which is legal
-        tagCurrent->setContent(SUTIL_INVOKE(trim(token)));
-        token = "";
-        changeState(psConsume);
-        rewind();	// rewind so we will see tag start next time
-      } else {
-        token += c;
-      }
-      break;
-    case psDocType:
-      if (c == '>') {
-          token = "";
-          changeState(psConsume);
-      }
-      break;
-    } // switch
-  } // while (!eof)
-} // parseData
+// Appends the matches to 'result', returns the number of matches
+size_t DocPath::findAll(ITag *from, std::vector<ITag *> &result) {
+  size_t before = result.size();
+  if (!valid || (from == NULL)) return 0;
+  Candidates candidates(steps.size());
+  evaluate(from, 0, candidates, &result, NULL);
+  return result.size() - before;
+}
 
-// -- Tag's
-Tag::Tag(std::string _name) {
-  setName(_name);
-  content.clear();
-  parent = NULL;
+ITag *DocPath::findFirst(Document *doc, std::string tag, std::string value) {
+  return findTag(doc->getRoot(), tag, value);
 }
 
-Tag::~Tag() {
+ITag *DocPath::findTag(ITag *node, const std::string &tag, const std::string &value) {
+  std::list<ITag *> &children = node->getChildren();
+  for(std::list<ITag *>::iterator it = children.begin(); it != children.end(); it++) {
+    ITag *child = *it;
+    if ((child->getNameView() == StringView(tag)) && (child->getContentView() == StringView(value))) return child;
+    ITag *found = findTag(child, tag, value);
+    if (found != NULL) return found;
+  }
+  return NULL;
+}
+
+
 
+// -- Path extractor
+PathExtractor::PathExtractor() {
 }
 
-void Tag::addAttribute(std::string _name, std::string _value) {
-  Attribute *attr = new Attribute();
-  attr->setName(_name);
-  attr->setValue(_value);
-  //printf("AddAttr: '%s' : '%s'\n",_name.c_str(), _value.c_str());
-  attributes.push_back(attr);
+void PathExtractor::add(DocPath *query, OnPathMatchDelegate onMatch) {
+  Query q;
+  q.path = query;
+  q.onMatch = onMatch;
+  queries.push_back(q);
 }
 
-void Tag::addChild(Tag *tag) {
-  getChildren().push_back(tag);
-  tag->setParent(this);
+void PathExtractor::reset() {
+  live.clear();
+  frames.clear();
 }
 
-void Tag::setParent(Tag *tag) {
-  parent = tag;
+// Tests the tag against the step at its depth, content is not known yet
+bool PathExtractor::matchStep(uint32_t idxQuery, ITag *pTag, size_t depth) {
+  DocPath *path = queries[idxQuery].path;
+  if (!path->valid || (depth >= path->steps.size())) return false;
+  const DocPath::Step &step = path->steps[depth];
+  if (!step.wildcard && (pTag->getNameView() != StringView(step.name))) return false;
+  return path->matches(pTag, step, false);
 }
 
-ITag *Tag::getParent() {
-  return parent;
+void PathExtractor::StartTag(ITag *pTag) {
+  size_t depth = frames.size();
+  size_t idxStart = live.size();
+  if (depth == 0) {
+    // top level tags are tested against all queries
+    for(uint32_t i = 0; i < queries.size(); i++) {
+      if (matchStep(i, pTag, depth)) live.push_back(i);
+    }
+  } else {
+    // the parent's frame is the range from its start to ours
+    for(size_t idx = frames.back(); idx < idxStart; idx++) {
+      if (matchStep(live[idx], pTag, depth)) live.push_back(live[idx]);
+    }
+  }
+  frames.push_back(idxStart);
 }
 
+bool PathExtractor::SkipSubtree(ITag *) {
+  return (live.size() == frames.back());
+}
 
-bool Tag::hasContent() {
-  return (!content.empty());
+void PathExtractor::EndTag(ITag *pTag) {
+  // the parser reports broken end tags without a tag, nothing was popped
+  if ((pTag == NULL) || frames.empty()) return;
+  size_t depth = frames.size() - 1;
+  for(size_t idx = frames.back(); idx < live.size(); idx++) {
+    Query &q = queries[live[idx]];
+    if ((depth + 1) != q.path->steps.size()) continue;
+    if (q.path->matches(pTag, q.path->steps[depth])) q.onMatch(q.path, pTag);
+  }
+  live.resize(frames.back());
+  frames.pop_back();
+}
+
+// -- Escaping
+const XmlEscape::Entity XmlEscape::entities[5] = {
+  { "amp", 3, '&' },
+  { "apos", 4, '\'' },
+  { "gt", 2, '>' },
+  { "lt", 2, '<' },
+  { "quot", 4, '"' },
+};
+
+const char *XmlEscape::escapes[] = {
+  NULL, "&amp;", "&lt;", "&gt;", "&quot;", "&#9;", "&#10;", "&#13;",
+};
+
+const uint8_t XmlEscape::escapeIndex[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 6, 0, 0, 7, 0, 0,   // '\t', '\n', '\r'
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 4, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,   // '"', '&'
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 3, 0,   // '<', '>'
+};
+
+size_t XmlEscape::findEscape(const char *data, size_t idx, size_t len, bool inAttribute) {
+  while(idx < len) {
+    uint8_t esc = escapeIndex[(unsigned char)data[idx]];
+    if ((esc != 0) && (inAttribute || (esc < firstAttributeEscape))) break;
+    idx++;
+  }
+  return idx;
+}
+
+// Writes the UTF-8 encoding of the reference in 'ref' (without '&' and ';') to 'dst', returns 0 if it isn't one
+static size_t decodeEntity(const char *ref, size_t len, char *dst) {
+  if ((len > 1) && (ref[0] == '#')) {
+    uint32_t code = 0;
+    size_t idx = 1;
+    int base = 10;
+    if ((ref[1] == 'x') || (ref[1] == 'X')) {
+      base = 16;
+      idx++;
+    }
+    if (idx == len) return 0;
+    for(; idx < len; idx++) {
+      int digit;
+      char c = ref[idx];
+      if ((c >= '0') && (c <= '9')) digit = c - '0';
+      else if ((base == 16) && (c >= 'a') && (c <= 'f')) digit = c - 'a' + 10;
+      else if ((base == 16) && (c >= 'A') && (c <= 'F')) digit = c - 'A' + 10;
+      else return 0;
+      code = code * base + digit;
+      if (code > 0x10ffff) return 0;
+    }
+    if ((code == 0) || ((code >= 0xd800) && (code <= 0xdfff))) return 0;
+    if (code < 0x80) {
+      dst[0] = (char)code;
+      return 1;
+    } else if (code < 0x800) {
+      dst[0] = (char)(0xc0 | (code >> 6));
+      dst[1] = (char)(0x80 | (code & 0x3f));
+      return 2;
+    } else if (code < 0x10000) {
+      dst[0] = (char)(0xe0 | (code >> 12));
+      dst[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+      dst[2] = (char)(0x80 | (code & 0x3f));
+      return 3;
+    }
+    dst[0] = (char)(0xf0 | (code >> 18));
+    dst[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    dst[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    dst[3] = (char)(0x80 | (code & 0x3f));
+    return 4;
+  }
+  for(size_t i=0;i<sizeof(XmlEscape::entities)/sizeof(XmlEscape::entities[0]);i++) {
+    const XmlEscape::Entity &entity = XmlEscape::entities[i];
+    if ((entity.len == len) && !memcmp(entity.name, ref, len)) {
+      dst[0] = entity.c;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Copies in runs between the '&', the output never gets ahead of the input so in place works
+size_t XmlEscape::decode(const char *src, size_t len, char *dst) {
+  // longest reference we bother with, '&#x10FFFF;' with a few leading zeros
+  const size_t maxRef = 16;
+  size_t idx = 0;
+  size_t idxOut = 0;
+  while(idx < len) {
+    size_t idxAmp = XmlScan::findChar(src, idx, len, '&');
+    if (idxAmp > idx) {
+      memmove(dst + idxOut, src + idx, idxAmp - idx);
+      idxOut += idxAmp - idx;
+    }
+    if (idxAmp == len) break;
+    size_t idxEnd = idxAmp + 1;
+    while((idxEnd < len) && ((idxEnd - idxAmp) < maxRef) && (src[idxEnd] != ';') && (src[idxEnd] != '&')) {
+      idxEnd++;
+    }
+    size_t n = 0;
+    if ((idxEnd < len) && (src[idxEnd] == ';')) {
+      n = decodeEntity(src + idxAmp + 1, idxEnd - idxAmp - 1, dst + idxOut);
+    }
+    if (n > 0) {
+      idxOut += n;
+      idx = idxEnd + 1;
+    } else {
+      dst[idxOut++] = '&';
+      idx = idxAmp + 1;
+    }
+  }
+  return idxOut;
+}
+
+// -- Output buffer
+void OutputBuffer::putEscaped(const StringView &s, bool inAttribute) {
+  const char *ptr = s.data();
+  size_t len = s.length();
+  size_t idx = 0;
+  while(idx < len) {
+    size_t idxEscape = XmlEscape::findEscape(ptr, idx, len, inAttribute);
+    if (idxEscape > idx) put(ptr + idx, idxEscape - idx);
+    if (idxEscape == len) break;
+    const char *escaped = XmlEscape::escape(ptr[idxEscape], inAttribute);
+    put(escaped, strlen(escaped));
+    idx = idxEscape + 1;
+  }
 }
 
+void OutputBuffer::putIndent(size_t n) {
+  static const char spaces[] = "                                ";
+  while(n > 0) {
+    size_t len = (n < sizeof(spaces)-1) ? n : sizeof(spaces)-1;
+    put(spaces, len);
+    n -= len;
+  }
+}
 
-std::string Tag::toString() {
-  return std::string(name + " ("+content+")");
+void OutputBuffer::flush() {
+  if ((pSink == NULL) || data.empty()) return;
+  pSink->write(data.data(), data.length());
+  data.clear();
 }
 
-bool Tag::hasAttribute(std::string name) {
-  std::list<IAttribute *>::iterator it = attributes.begin();
-  for(;it != attributes.end();it++) {
-    IAttribute *pAttribute = *it;
-    if (!strcmp(pAttribute->getName().c_str(), name.c_str())) return true;
-  }
-  return false;
+// -- Document writer
+DocumentWriter::DocumentWriter(OutputBuffer &out, int flags, size_t indent) : out(out) {
+  this->flags = flags;
+  this->indent = indent;
 }
 
-std::string Tag::getAttributeValue(std::string name, std::string defValue) {
-  std::list<IAttribute *>::iterator it = attributes.begin();
-  for(;it != attributes.end();it++) {
-    IAttribute *pAttribute = *it;
-    //printf("attr: %s\n",pAttribute->getName().c_str());
-    if (!strcmp(pAttribute->getName().c_str(), name.c_str())) return pAttribute->getValue();
+void DocumentWriter::write(IDocument *pDoc) {
+  std::list<ITag *> &children = pDoc->getRoot()->getChildren();
+  for(std::list<ITag *>::iterator it = children.begin(); it != children.end(); it++) {
+    writeTag(*it);
   }
-  return defValue;
 }
 
-ITag *Tag::getFirstChild(std::string name) {
-  std::list<ITag *>::iterator it = children.begin();
-  for(;it != children.end(); it++) {
-    ITag *child = *it;
-    if (!strcmp(child->getName().c_str(), name.c_str())) return child;
-  }
-  return NULL;
+void DocumentWriter::write(ITag *pTag) {
+  writeTag(pTag);
 }
 
-ITag *Tag::getChildWithAttributeValue(std::string name, std::string attribute, std::string value) {
-  std::list<ITag *>::iterator it = children.begin();
-  for(;it != children.end(); it++) {
-    ITag *child = *it;
- 
-    if (!strcmp(child->getName().c_str(), name.c_str())) {
-
-      if (child->hasAttribute(attribute)) {
-        std::string chval = child->getAttributeValue(attribute,"");
-        if (!strcmp(chval.c_str(), value.c_str())) {
-          return child;
-        }
-      }
+std::string DocumentWriter::toString(IDocument *pDoc, int flags) {
+  OutputBuffer out;
+  DocumentWriter writer(out, flags);
+  writer.write(pDoc);
+  return out.getData();
+}
+
+std::string DocumentWriter::toString(ITag *pTag, int flags) {
+  OutputBuffer out;
+  DocumentWriter writer(out, flags);
+  writer.write(pTag);
+  return out.getData();
+}
+
+// Open tags and the next child to write are kept on an explicit stack, deep documents don't recurse
+void DocumentWriter::writeTag(ITag *pTag) {
+  if (!writeStart(pTag, 0)) return;
+  std::vector<WriteFrame> stack;
+  stack.push_back(WriteFrame(pTag));
+  while(!stack.empty()) {
+    WriteFrame &top = stack.back();
+    if (top.it == top.end) {
+      writeEnd(top.pTag, stack.size() - 1);
+      stack.pop_back();
+      continue;
+    }
+    ITag *pChild = *top.it++;
+    if (writeStart(pChild, stack.size())) {
+      stack.push_back(WriteFrame(pChild));
     }
   }
-  return NULL;
 }
 
-// -- Document container
-Document::Document() {
-  root = NULL;
+// Writes the start tag and content, a tag without children is closed as well. Returns true if the children follow.
+bool DocumentWriter::writeStart(ITag *pTag, size_t depth) {
+  if (flags & wfPretty) out.putIndent(depth * indent);
+  StringView name = pTag->getNameView();
+  out.put('<');
+  // processing instructions have nothing but attributes
+  if (pTag->isInstruction()) {
+    out.put('?');
+    out.put(name);
+    writeAttributes(pTag);
+    out.put("?>", 2);
+    newLine();
+    return false;
+  }
+  out.put(name);
+  writeAttributes(pTag);
+
+  StringView content = pTag->getContentView();
+  std::list<ITag *> &children = pTag->getChildren();
+  if (content.empty() && children.empty()) {
+    out.put("/>", 2);
+    newLine();
+    return false;
+  }
+  out.put('>');
+  out.putEscaped(content, false);
+  if (children.empty()) {
+    out.put("</", 2);
+    out.put(name);
+    out.put('>');
+    newLine();
+    return false;
+  }
+  newLine();
+  return true;
+}
+
+void DocumentWriter::writeEnd(ITag *pTag, size_t depth) {
+  if (flags & wfPretty) out.putIndent(depth * indent);
+  out.put("</", 2);
+  out.put(pTag->getNameView());
+  out.put('>');
+  newLine();
+}
+
+void DocumentWriter::writeAttributes(ITag *pTag) {
+  std::list<IAttribute *> &attributes = pTag->getAttributes();
+  for(std::list<IAttribute *>::iterator it = attributes.begin(); it != attributes.end(); it++) {
+    out.put(' ');
+    out.put((*it)->getNameView());
+    out.put("=\"", 2);
+    out.putEscaped((*it)->getValueView(), true);
+    out.put('"');
+  }
 }
 
-Document::~Document() {
+void DocumentWriter::newLine() {
+  if (flags & wfPretty) out.put('\n');
+}
+
+// -- XML writer
+XmlWriter::XmlWriter(OutputBuffer &out, int flags, size_t indent) : out(out) {
+  this->flags = flags;
+  this->indent = indent;
+  tagOpen = false;
+  needNewLine = false;
+}
+
+void XmlWriter::declaration(const StringView &encoding) {
+  out.put("<?xml version=\"1.0\" encoding=\"", 30);
+  out.putEscaped(encoding, true);
+  out.put("\"?>", 3);
+  needNewLine = true;
+}
+
+void XmlWriter::startElement(const StringView &name) {
+  closeStartTag();
+  if (!frames.empty()) frames.back().hasChildren = true;
+  beginLine();
+  out.put('<');
+  out.put(name);
+
+  Frame frame;
+  frame.nameStart = names.length();
+  frame.hasChildren = frame.hasText = false;
+  frames.push_back(frame);
+  names.append(name.data(), name.length());
+  tagOpen = true;
+  needNewLine = true;
+}
+
+bool XmlWriter::attribute(const StringView &name, const StringView &value) {
+  if (!tagOpen) return false;
+  out.put(' ');
+  out.put(name);
+  out.put("=\"", 2);
+  out.putEscaped(value, true);
+  out.put('"');
+  return true;
+}
+
+bool XmlWriter::text(const StringView &content) {
+  if (frames.empty()) return false;
+  closeStartTag();
+  out.putEscaped(content, false);
+  frames.back().hasText = true;
+  return true;
+}
+
+// The content goes as is, it must not hold '--'
+void XmlWriter::comment(const StringView &content) {
+  closeStartTag();
+  if (!frames.empty()) frames.back().hasChildren = true;
+  beginLine();
+  out.put("<!--", 4);
+  out.put(content);
+  out.put("-->", 3);
+  needNewLine = true;
+}
+
+bool XmlWriter::endElement() {
+  if (frames.empty()) return false;
+  Frame frame = frames.back();
+  frames.pop_back();
+  if (tagOpen) {
+    out.put("/>", 2);
+    tagOpen = false;
+  } else {
+    if (frame.hasChildren && !frame.hasText) beginLine();
+    out.put("</", 2);
+    out.put(names.data() + frame.nameStart, names.length() - frame.nameStart);
+    out.put('>');
+  }
+  names.resize(frame.nameStart);
+  needNewLine = true;
+  return true;
+}
 
+void XmlWriter::finish() {
+  while(endElement());
+  if ((flags & wfPretty) && needNewLine) out.put('\n');
+  needNewLine = false;
+  out.flush();
 }
 
-void Document::traverse(OnTagDelegate startHandler, OnTagDelegate endHandler) {
-  traverseNodes(startHandler, endHandler, root->getChildren());
+void XmlWriter::closeStartTag() {
+  if (!tagOpen) return;
+  out.put('>');
+  tagOpen = false;
 }
 
-void Document::traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler) {
-  traverseNodes(startHandler, endHandler, node->getChildren());
+// Pretty printing puts each tag on its own line, except within elements holding text
+void XmlWriter::beginLine() {
+  if (!(flags & wfPretty)) return;
+  if (!frames.empty() && frames.back().hasText) return;
+  if (needNewLine) out.put('\n');
+  out.putIndent(frames.size() * indent);
 }
 
+// -- Scanning kernels
+#ifdef XML_PARSER_SIMD_SSE2
+static __inline int firstBit(unsigned int mask) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return (int)idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif
 
-void Document::traverseNodes(OnTagDelegate startHandler, OnTagDelegate endHandler, std::list<ITag *> &tags) {
-  std::list<ITag *>::iterator it = tags.begin();
-  while(it != tags.end()) {
-    ITag *tag = *it;
-    startHandler(tag, tag->getAttributes());
-    traverseNodes(startHandler, endHandler, tag->getChildren());
-    endHandler(tag, tag->getAttributes());
-    it++;
+size_t XmlScan::findChar(const char *data, size_t idx, size_t len, char c) {
+#ifdef XML_PARSER_SIMD_AVX2
+  const __m256i needle32 = _mm256_set1_epi8(c);
+  while((idx + 32) <= len) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + idx));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32));
+    if (mask != 0) return idx + firstBit(mask);
+    idx += 32;
+  }
+#endif
+#ifdef XML_PARSER_SIMD_SSE2
+  const __m128i needle = _mm_set1_epi8(c);
+  while((idx + 16) <= len) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + idx));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask != 0) return idx + firstBit(mask);
+    idx += 16;
+  }
+#endif
+  while((idx < len) && (data[idx] != c)) idx++;
+  return idx;
+}
+
+// Stops at white space (anything <= ' ' to keep it simple) and '=', '>', '/', '?', '"'
+size_t XmlScan::findNameEnd(const char *data, size_t idx, size_t len) {
+#ifdef XML_PARSER_SIMD_SSE2
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i eq = _mm_set1_epi8('=');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i question = _mm_set1_epi8('?');
+  const __m128i quote = _mm_set1_epi8('"');
+  while((idx + 16) <= len) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + idx));
+    // unsigned 'chunk <= space'
+    __m128i hits = _mm_cmpeq_epi8(_mm_max_epu8(chunk, space), space);
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, eq));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, gt));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, slash));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, question));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, quote));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+    if (mask != 0) return idx + firstBit(mask);
+    idx += 16;
   }
+#endif
+  while((idx < len) && !isNameEnd(data[idx])) {
+    idx++;
+  }
+  return idx;
 }
 
-std::string Document::indentString(int depth) {
-  std::string s= "";
-  for(int i=0;i<depth;i++) s+=" ";
-  return s;
+// Multi-byte sequences are checked one by one, in between ASCII is skipped 16 or 32 bytes at a time
+size_t XmlScan::findInvalidUTF8(const char *data, size_t idx, size_t len) {
+  while(idx < len) {
+#if defined(XML_PARSER_SIMD_AVX2)
+    while(((idx + 32) <= len) && (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(data + idx))) == 0)) {
+      idx += 32;
+    }
+#endif
+#ifdef XML_PARSER_SIMD_SSE2
+    while(((idx + 16) <= len) && (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data + idx))) == 0)) {
+      idx += 16;
+    }
+#endif
+    while((idx < len) && ((unsigned char)data[idx] < 0x80)) {
+      idx++;
+      // back to the wide loop once aligned to a run of ASCII again
+      if ((idx & 15) == 0) break;
+    }
+    if ((idx >= len) || ((unsigned char)data[idx] < 0x80)) continue;
+
+    unsigned char lead = (unsigned char)data[idx];
+    size_t szSequence = utf8Length(lead);
+    if ((szSequence < 2) || ((idx + szSequence) > len)) return idx;
+    static const uint32_t minCode[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    uint32_t code = lead & (0x7f >> szSequence);
+    for(size_t i = 1; i < szSequence; i++) {
+      unsigned char c = (unsigned char)data[idx + i];
+      if ((c & 0xc0) != 0x80) return idx;
+      code = (code << 6) | (c & 0x3f);
+    }
+    if ((code < minCode[szSequence]) || (code > 0x10ffff) || ((code >= 0xd800) && (code <= 0xdfff))) return idx;
+    idx += szSequence;
+  }
+  return len;
+}
+
+// Space: ' ', '\t', '\n', '\r'. Name end: control chars, space, '=', '>', '/', '?', '"'
+const uint8_t XmlScan::charClass[256] = {
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 2, 2, 3, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  3, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2,
+};
+
+// -- Mapped file
+MappedFile::MappedFile() {
+  pData = NULL;
+  szData = 0;
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+#ifdef XML_PARSER_NO_MMAP
+bool MappedFile::open(const std::string &filename) {
+  close();
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL) return false;
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *buffer = (char *)malloc(len > 0 ? len : 1);
+  if ((buffer == NULL) || ((len > 0) && (fread(buffer, 1, len, f) != (size_t)len))) {
+    free(buffer);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+  pData = buffer;
+  szData = (size_t)len;
+  return true;
+}
+
+void MappedFile::close() {
+  free((void *)pData);
+  pData = NULL;
+  szData = 0;
+}
+#elif defined(_WIN32)
+bool MappedFile::open(const std::string &filename) {
+  close();
+  HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (hFile == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(hFile, &size)) {
+    CloseHandle(hFile);
+    return false;
+  }
+  if (size.QuadPart == 0) {
+    // can't map empty files
+    CloseHandle(hFile);
+    pData = "";
+    return true;
+  }
+  HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(hFile);
+  if (hMapping == NULL) return false;
+  // the view keeps the mapping alive
+  pData = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(hMapping);
+  if (pData == NULL) return false;
+  szData = (size_t)size.QuadPart;
+  return true;
+}
+
+void MappedFile::close() {
+  if (szData > 0) UnmapViewOfFile(pData);
+  pData = NULL;
+  szData = 0;
+}
+#else
+bool MappedFile::open(const std::string &filename) {
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    // can't map empty files
+    ::close(fd);
+    pData = "";
+    return true;
+  }
+  void *mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after close
+  ::close(fd);
+  if (mem == MAP_FAILED) return false;
+  madvise(mem, (size_t)st.st_size, MADV_SEQUENTIAL);
+  pData = (const char *)mem;
+  szData = (size_t)st.st_size;
+  return true;
 }
 
-// DEBUG HELPER!
-void Document::dumpTagTree(ITag *root, int depth) {
-  std::string indent = indentString(depth);
-  //System.out.println(indent+"T:"+root->getName());
-  printf("%sT:%s\n",indent.c_str(), root->getName().c_str());
-  std::list<ITag *> &tags  = root->getChildren();
+void MappedFile::close() {
+  if (szData > 0) munmap((void *)pData, szData);
+  pData = NULL;
+  szData = 0;
+}
+#endif
 
-  std::list<ITag *>::iterator it = tags.begin();
-  while(it != tags.end()) {
-    ITag *child = *it;
-    dumpTagTree(child, depth+2);
-    it++;
-  }		
+// -- Name table
+NameTable::NameTable() {
+  slots.assign(16, 0);
+  intern(StringView());
 }
 
+uint32_t NameTable::intern(const StringView &name) {
+  uint32_t h = NameIndex<Tag>::hash(name);
+  uint32_t &slot = findSlot(name, h);
+  if (slot != 0) return slot - 1;
 
-DocPath::DocPath() {
-  pathSeparator = DOCPATH_DEFAULT_SEPARATOR;
+  uint32_t id = (uint32_t)names.size();
+  char *copy = (char *)arena.alloc(name.length());
+  memcpy(copy, name.data(), name.length());
+  names.push_back(StringView(copy, name.length()));
+  hashes.push_back(h);
+  slot = id + 1;
+  // keep the load below one half
+  if ((names.size() * 2) > slots.size()) grow();
+  return id;
 }
 
-DocPath::DocPath(std::string separator) {
-  pathSeparator = separator;
+uint32_t NameTable::find(const StringView &name) {
+  uint32_t slot = findSlot(name, NameIndex<Tag>::hash(name));
+  return (slot == 0)?NAME_NONE:(slot - 1);
 }
 
-ITag *DocPath::findFirst(Document *doc, std::string tag, std::string value) {
-  searchTag = tag;
-  searchValue = value;
-  findResult = NULL;
+uint32_t &NameTable::findSlot(const StringView &name, uint32_t h) {
+  size_t mask = slots.size() - 1;
+  size_t idx = h & mask;
+  while((slots[idx] != 0) && ((hashes[slots[idx] - 1] != h) || (names[slots[idx] - 1] != name))) {
+    idx = (idx + 1) & mask;
+  }
+  return slots[idx];
+}
 
-  doc->traverse(
-    std::bind(&DocPath::onDefinitionTagDataStart,this, std::placeholders::_1, std::placeholders::_2),
-    std::bind(&DocPath::onDefinitionTagDataEnd,this, std::placeholders::_1, std::placeholders::_2));
-  return findResult;
+void NameTable::grow() {
+  slots.assign(slots.size() * 2, 0);
+  size_t mask = slots.size() - 1;
+  for(uint32_t id = 0; id < names.size(); id++) {
+    size_t idx = hashes[id] & mask;
+    while(slots[idx] != 0) idx = (idx + 1) & mask;
+    slots[idx] = id + 1;
+  }
 }
 
-// call back from XML Parser
-void DocPath::onDefinitionTagDataStart(ITag *tag, std::list<IAttribute *>&attributes) {
-  if (findResult != NULL) return;
-  if (tag->getName() != searchTag) return;
-  if (tag->getContent() != searchValue) return;
+// -- Arena
+Arena::Arena() {
+  blocks = NULL;
+  freeBlocks = NULL;
+  cleanups = NULL;
+  nextBlockSize = XML_PARSER_ARENA_FIRST_BLOCK;
+  bytesAllocated = 0;
+}
 
-  printf("assign find result, %s:%s\n",tag->getName().c_str(), tag->getContent().c_str());
-  findResult = tag;
+Arena::~Arena() {
+  reset();
+  while(freeBlocks != NULL) {
+    Block *next = freeBlocks->next;
+    ::operator delete(freeBlocks);
+    freeBlocks = next;
+  }
 }
 
-void DocPath::onDefinitionTagDataEnd(ITag *tag, std::list<IAttribute *>&attributes) {
+// Block header rounded up to the allocation alignment
+size_t Arena::headerSize() {
+  const size_t align = 2*sizeof(void *);
+  return (sizeof(Block) + align - 1) & ~(align - 1);
 }
 
+void *Arena::alloc(size_t sz) {
+  // keep everything pointer-pair aligned
+  const size_t align = 2*sizeof(void *);
+  sz = (sz + align - 1) & ~(align - 1);
+  if ((blocks == NULL) || ((blocks->used + sz) > blocks->size)) {
+    newBlock(sz);
+  }
+  char *mem = ((char *)blocks) + blocks->used;
+  blocks->used += sz;
+  bytesAllocated += sz;
+  return mem;
+}
+
+// Takes the first retained block large enough, only allocates when there is none
+Arena::Block *Arena::newBlock(size_t minSize) {
+  Block **ppFree = &freeBlocks;
+  while(*ppFree != NULL) {
+    Block *block = *ppFree;
+    if (block->size >= (minSize + headerSize())) {
+      *ppFree = block->next;
+      block->next = blocks;
+      blocks = block;
+      return block;
+    }
+    ppFree = &block->next;
+  }
+
+  size_t size = nextBlockSize;
+  if (size < (minSize + headerSize())) size = minSize + headerSize();
+  if (nextBlockSize < XML_PARSER_ARENA_MAX_BLOCK) nextBlockSize *= 2;
+
+  Block *block = (Block *)::operator new(size);
+  block->size = size;
+  block->used = headerSize();
+  block->next = blocks;
+  blocks = block;
+  return block;
+}
+
+// Destroys all objects and rewinds the blocks, they are reused in the order they were first handed out
+void Arena::reset() {
+  releaseCleanups();
+  while(blocks != NULL) {
+    Block *next = blocks->next;
+    blocks->used = headerSize();
+    blocks->next = freeBlocks;
+    freeBlocks = blocks;
+    blocks = next;
+  }
+  bytesAllocated = 0;
+}
 
+void Arena::releaseCleanups() {
+  while(cleanups != NULL) {
+    cleanups->fnDestroy(cleanups->obj);
+    cleanups = cleanups->next;
+  }
+}
 
 /////////// -- StringUtils.cpp
 ///////// -------- Class StringUtil
@@ -507,17 +3309,19 @@ std::string &StringUtil::trim( std::string& str, const std::string& trimChars /*
   return str;
 }
 
+StringView StringUtil::trim(const StringView &str)
+{
+  return StringUtilStatic::trim(str);
+}
+
 std::string StringUtil::toLower(std::string s) {
-  std::string res = "";
-  for(size_t i=0;i<s.length();i++) {
-    res+=((char)tolower(s.at(i)));
-  }
-  return res;
+  return StringUtilStatic::toLower(std::move(s));
 }
-bool StringUtil::equalsIgnoreCase(std::string a, std::string b) {
-  std::string sa = toLower(a);
-  std::string sb = toLower(b);
-  return (sa==sb);
+bool StringUtil::equalsIgnoreCase(const std::string &a, const std::string &b) {
+  return StringUtilStatic::equalsIgnoreCase(a, b);
+}
+bool StringUtil::equalsIgnoreCase(const StringView &a, const StringView &b) {
+  return StringUtilStatic::equalsIgnoreCase(a, b);
 }
 
 
@@ -559,9 +3363,9 @@ std::string StringUtilStatic::whiteSpaces( " \f\n\r\t\v" );
 
 // -- ParseStateFuncs.cpp
 
-ParseStateFunc::ParseStateFunc(std::string _data, IParseEvents *pEventHandler)
+ParseStateFunc::ParseStateFunc(std::string _data, IParseEvents *pEventHandler, int flags)
 {
-  initialize(_data, pEventHandler);
+  initialize(std::move(_data), pEventHandler, flags);
 }
 
 void ParseStateFunc::stateConsume(char c) {
@@ -732,7 +3536,6 @@ void ParseStateFunc::stateDTDDocTypeContent(char c) {
 
 void ParseStateFunc::parseData() {
   char c;
-  tagStack.push(root);
   while((c=nextChar())!=EOF) {
     switch(state) 
     {
@@ -766,6 +3569,9 @@ void ParseStateFunc::parseData() {
     case psDocType:
       stateDTDDocTypeContent(c);
       break;
+    default :
+      // subtree skipping is only done by ParserCore
+      break;
     }
   }
 }
@@ -1003,7 +3809,7 @@ void StateTagDTDDocType::consume(char c) {
   }
 }
 
-ParseStateClasses::ParseStateClasses(std::string _data, IParseEvents *pEventHandler)
+ParseStateClasses::ParseStateClasses(std::string _data, IParseEvents *pEventHandler, int flags)
 {
   stateConsume.pContext = this;
   stateConsume.pContext = this;
@@ -1018,7 +3824,7 @@ ParseStateClasses::ParseStateClasses(std::string _data, IParseEvents *pEventHand
   stateTagDTDDocType.pContext = this;
   pState = dynamic_cast<IParseState *>(&stateConsume);
 
-  initialize(_data, pEventHandler);
+  initialize(std::move(_data), pEventHandler, flags);
 }
 
 void ParseStateClasses::changeState(kParseState newState) {
@@ -1041,15 +3847,14 @@ void ParseStateClasses::changeState(kParseState newState) {
   if (pState != NULL) pState->enter();
 }
 
-void ParseStateClasses::initialize(std::string _data, IParseEvents *pEventHandler)
+void ParseStateClasses::initialize(std::string _data, IParseEvents *pEventHandler, int flags)
 {
-  Parser::initialize(_data, pEventHandler);
+  Parser::initialize(_data, pEventHandler, flags);
 }
 
 void ParseStateClasses::parseData()
 {
   char c;
-  tagStack.push(root);
   while((c=nextChar())!=EOF) {
     if (pState != NULL) {
       pState->consume(c);
@@ -21,25 +21,149 @@ TODO: [ -:Not done, +:In progress, !:Completed]
 
 #include <string>
 #include <list>
+#include <vector>
 #include <stack>
 #include <functional>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <stdint.h>
+#include <new>
 
 namespace gnilk {
   namespace xml {
 
     // -- start config
 #define XML_PARSER_STATIC_STRING_UTIL
+#define XML_PARSER_ARENA_FIRST_BLOCK (4096)
+#define XML_PARSER_ARENA_MAX_BLOCK (1024*1024)
+// Define if the platform has no mmap, files are then read into memory
+//#define XML_PARSER_NO_MMAP
+// Define to use the plain C versions of the scanning kernels
+//#define XML_PARSER_NO_SIMD
+// Name lookups on tags with at least this many children/attributes go through a hash index
+#define XML_PARSER_INDEX_THRESHOLD (16)
+// Define to always do linear scans in the lookups
+//#define XML_PARSER_NO_INDEX
+// Smallest chunk handed to a worker thread by Parser::loadXMLParallel
+#define XML_PARSER_PARALLEL_MIN_CHUNK (1024*1024)
+// Define if the platform has no std::thread, Parser::loadXMLParallel then parses sequentially
+//#define XML_PARSER_NO_THREADS
+// Output buffers with a sink hand the data over once they have grown past this
+#define XML_PARSER_WRITE_BUFFER (64*1024)
 
     // -- end config
 
 
 
+#ifndef XML_PARSER_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define XML_PARSER_SIMD_SSE2
+#endif
+#if defined(__AVX2__)
+#define XML_PARSER_SIMD_AVX2
+#endif
+#endif
+
 #ifdef XML_PARSER_STATIC_STRING_UTIL
 #define SUTIL_INVOKE(__x__) (StringUtilStatic::__x__)
 #else
 #define SUTIL_INVOKE(__x__) (sUtil->__x__)
 #endif
 
+    //
+    // Non-owning reference to a run of characters, normally a slice of the parser input buffer.
+    // Used by the zero-copy parse mode, strings are only materialized when asked for.
+    //
+    class StringView {
+    public:
+      StringView() : ptr(""), len(0) {}
+      StringView(const char *_ptr, size_t _len) : ptr(_ptr), len(_len) {}
+      StringView(const char *str) : ptr(str), len(strlen(str)) {}
+      StringView(const std::string &str) : ptr(str.c_str()), len(str.length()) {}
+
+      const char *data() const { return ptr; }
+      size_t length() const { return len; }
+      bool empty() const { return (len == 0); }
+      std::string toString() const { return std::string(ptr, len); }
+
+      bool equals(const StringView &other) const {
+        return ((len == other.len) && !memcmp(ptr, other.ptr, len));
+      }
+      bool operator == (const StringView &other) const { return equals(other); }
+      bool operator != (const StringView &other) const { return !equals(other); }
+    private:
+      const char *ptr;
+      size_t len;
+    };
+
+    //
+    // Scanning kernels, skips runs of uninteresting chars 32 (AVX2) or 16 (SSE2) bytes at a time.
+    // The find functions return the index of the first hit or 'len' if there is none.
+    // The data is UTF-8, bytes of multi-byte sequences are never space or markup so they end up in names and text.
+    //
+    class XmlScan {
+    public:
+      static size_t findChar(const char *data, size_t idx, size_t len, char c);
+      static size_t findNameEnd(const char *data, size_t idx, size_t len);
+      // First byte not starting a complete and valid UTF-8 sequence (overlong forms, surrogates and
+      // code points above U+10FFFF are invalid), ASCII runs are skipped in one go.
+      static size_t findInvalidUTF8(const char *data, size_t idx, size_t len);
+      // Length of the sequence started by 'lead', 0 if it can't start one
+      __inline static size_t utf8Length(unsigned char lead) {
+        if (lead < 0x80) return 1;
+        if ((lead & 0xe0) == 0xc0) return 2;
+        if ((lead & 0xf0) == 0xe0) return 3;
+        if ((lead & 0xf8) == 0xf0) return 4;
+        return 0;
+      }
+      // Length of the UTF-8 byte order mark at the start of the data, 0 if there is none
+      __inline static size_t skipBOM(const char *data, size_t len) {
+        return ((len >= 3) && !memcmp(data, "\xef\xbb\xbf", 3))?3:0;
+      }
+      // XML white space (space, tab, CR and LF)
+      __inline static bool isSpace(char c) { return (charClass[(unsigned char)c] & ccSpace) != 0; }
+      // Anything ending a name, everything else (UTF-8 sequences included) is part of it
+      __inline static bool isNameEnd(char c) { return (charClass[(unsigned char)c] & ccNameEnd) != 0; }
+    private:
+      enum kCharClass {
+        ccSpace = 1,
+        ccNameEnd = 2,
+      };
+      static const uint8_t charClass[256];
+    };
+
+    //
+    // The predefined entities, both ways. A char needing escaping maps to its entity, the entity
+    // table is ordered by name. Escaping is done in runs, chars not needing it are copied in bulk.
+    //
+    class XmlEscape {
+    public:
+      struct Entity {
+        const char *name;   // without '&' and ';'
+        size_t len;
+        char c;
+      };
+      static const Entity entities[5];
+      // Returns the escaped form of 'c' in text or attribute values, NULL if 'c' goes as is
+      __inline static const char *escape(unsigned char c, bool inAttribute) {
+        uint8_t idx = escapeIndex[c];
+        if ((idx == 0) || (!inAttribute && (idx >= firstAttributeEscape))) return NULL;
+        return escapes[idx];
+      }
+      // Index of the first char from 'idx' needing escaping, 'len' if there is none
+      static size_t findEscape(const char *data, size_t idx, size_t len, bool inAttribute);
+      // Decodes entities and character references ('&#65;', '&#x41;') from 'src' to 'dst', returns the
+      // decoded length. The result is never longer so 'dst' may be 'src'. Unknown entities are kept as is.
+      static size_t decode(const char *src, size_t len, char *dst);
+    private:
+      // chars map to an index in 'escapes', 0 = no escaping, from 'firstAttributeEscape' only in attribute values
+      static const uint8_t escapeIndex[256];
+      static const char *escapes[];
+      static const uint8_t firstAttributeEscape = 4;
+    };
+
     // TODO: Move to own file
     class StringUtil
     {
@@ -50,8 +174,10 @@ namespace gnilk {
       void trimRight( std::string& str, const std::string& trimChars = whiteSpaces );
       void trimLeft( std::string& str, const std::string& trimChars = whiteSpaces );
       std::string &trim( std::string& str, const std::string& trimChars = whiteSpaces );
+      StringView trim(const StringView &str);
       std::string toLower(std::string s);
-      bool equalsIgnoreCase(std::string a, std::string b);
+      bool equalsIgnoreCase(const std::string &a, const std::string &b);
+      bool equalsIgnoreCase(const StringView &a, const StringView &b);
 
     };
 
@@ -79,21 +205,215 @@ namespace gnilk {
         return str;
       }
 
+      // Trims a view without touching the underlying characters
+      __inline static StringView trim(const StringView &str)
+      {
+        const char *ptr = str.data();
+        size_t len = str.length();
+        while((len > 0) && XmlScan::isSpace(ptr[len-1])) len--;
+        while((len > 0) && XmlScan::isSpace(ptr[0])) { ptr++; len--; }
+        return StringView(ptr, len);
+      }
+
+      __inline static char toLower(char c) {
+        return ((c >= 'A') && (c <= 'Z'))?(char)(c + ('a' - 'A')):c;
+      }
       __inline static std::string toLower(std::string s) {
-        std::string res = "";
         for(size_t i=0;i<s.length();i++) {
-          res+=((char)tolower(s.at(i)));
+          s[i] = toLower(s[i]);
+        }
+        return s;
+      }
+      // ASCII case folding in place, nothing is allocated (bytes above 127 are compared as they are)
+      __inline static bool equalsIgnoreCase(const StringView &a, const StringView &b) {
+        if (a.length() != b.length()) return false;
+        const char *pa = a.data();
+        const char *pb = b.data();
+        for(size_t i=0;i<a.length();i++) {
+          if ((pa[i] != pb[i]) && (toLower(pa[i]) != toLower(pb[i]))) return false;
         }
-        return res;
+        return true;
       }
-      __inline static bool equalsIgnoreCase(std::string a, std::string b) {
-        std::string sa = toLower(a);
-        std::string sb = toLower(b);
-        return (sa==sb);
+      __inline static bool equalsIgnoreCase(const std::string &a, const std::string &b) {
+        return equalsIgnoreCase(StringView(a), StringView(b));
       }
 
     };
 
+    //
+    // Bump allocator, memory is only released when the arena dies.
+    // Blocks start small and double in size, so a whole tree ends up in a handful of allocations.
+    // A reset keeps all blocks and hands them out again, a reused arena stops allocating once it has grown.
+    // Objects created with 'create' get their destructor called when the arena releases its memory.
+    //
+    class Arena {
+    public:
+      Arena();
+      ~Arena();
+
+      void *alloc(size_t sz);
+      void reset();
+      size_t getBytesAllocated() { return bytesAllocated; }
+
+      template<typename T, typename... Args>
+      T *create(Args&&... args) {
+        void *mem = alloc(sizeof(T));
+        T *obj = new (mem) T(std::forward<Args>(args)...);
+        Cleanup *cleanup = (Cleanup *)alloc(sizeof(Cleanup));
+        cleanup->fnDestroy = &Arena::destroy<T>;
+        cleanup->obj = obj;
+        cleanup->next = cleanups;
+        cleanups = cleanup;
+        return obj;
+      }
+
+    private:
+      struct Block {
+        Block *next;
+        size_t size;
+        size_t used;
+      };
+      struct Cleanup {
+        void (*fnDestroy)(void *obj);
+        void *obj;
+        Cleanup *next;
+      };
+      template<typename T>
+      static void destroy(void *obj) { ((T *)obj)->~T(); }
+
+      static size_t headerSize();
+      Block *newBlock(size_t minSize);
+      void releaseCleanups();
+    private:
+      Block *blocks;
+      Block *freeBlocks;
+      Cleanup *cleanups;
+      size_t nextBlockSize;
+      size_t bytesAllocated;
+    };
+
+    //
+    // Read-only view of a file, memory mapped unless XML_PARSER_NO_MMAP is defined
+    //
+    class MappedFile {
+    public:
+      MappedFile();
+      ~MappedFile();
+
+      bool open(const std::string &filename);
+      void close();
+      const char *getData() { return pData; }
+      size_t getSize() { return szData; }
+    private:
+      const char *pData;
+      size_t szData;
+    };
+
+    //
+    // Name lookup table for the children or attributes of a tag, items with the same name are
+    // grouped in document order. Built in one go, lookups never allocate.
+    //
+    template<typename T>
+    class NameIndex {
+    public:
+      void build(T *first, T *(T::*fnNext)()) {
+        size_t count = 0;
+        for(T *it = first; it != NULL; it = (it->*fnNext)()) count++;
+        size_t capacity = 16;
+        while(capacity < count * 2) capacity <<= 1;
+        slots.assign(capacity, Slot());
+
+        // count the items per name, then give each name its range
+        for(T *it = first; it != NULL; it = (it->*fnNext)()) {
+          StringView name = it->getNameView();
+          Slot &slot = findSlot(name, hash(name));
+          if (!slot.used) {
+            slot.used = true;
+            slot.name = name;
+            slot.hash = hash(name);
+          }
+          slot.count++;
+        }
+        uint32_t start = 0;
+        for(size_t i = 0; i < slots.size(); i++) {
+          slots[i].start = start;
+          start += slots[i].count;
+          slots[i].count = 0;
+        }
+        items.resize(count);
+        for(T *it = first; it != NULL; it = (it->*fnNext)()) {
+          StringView name = it->getNameView();
+          Slot &slot = findSlot(name, hash(name));
+          items[slot.start + slot.count++] = it;
+        }
+      }
+
+      // Returns the first item called 'name' and the number of them, NULL if there is none
+      T **find(const StringView &name, size_t &count) {
+        count = 0;
+        if (slots.empty()) return NULL;
+        Slot &slot = findSlot(name, hash(name));
+        if (!slot.used) return NULL;
+        count = slot.count;
+        return &items[slot.start];
+      }
+
+      // FNV-1a
+      static uint32_t hash(const StringView &name) {
+        uint32_t h = 2166136261u;
+        for(size_t i = 0; i < name.length(); i++) {
+          h = (h ^ (unsigned char)name.data()[i]) * 16777619u;
+        }
+        return h;
+      }
+    private:
+      struct Slot {
+        Slot() : hash(0), start(0), count(0), used(false) {}
+        StringView name;
+        uint32_t hash;
+        uint32_t start;
+        uint32_t count;
+        bool used;
+      };
+      Slot &findSlot(const StringView &name, uint32_t h) {
+        size_t mask = slots.size() - 1;
+        size_t idx = h & mask;
+        while(slots[idx].used && ((slots[idx].hash != h) || (slots[idx].name != name))) {
+          idx = (idx + 1) & mask;
+        }
+        return slots[idx];
+      }
+    private:
+      std::vector<Slot> slots;
+      std::vector<T *> items;
+    };
+
+    #define NAME_NONE (0xffffffff)
+
+    //
+    // Interned names, each distinct name gets a small integer id (0 is the empty name) so names
+    // compare as integers. The characters are copied, ids are valid as long as the table.
+    //
+    class NameTable {
+    public:
+      NameTable();
+
+      uint32_t intern(const StringView &name);
+      // NAME_NONE if the name isn't in the table
+      uint32_t find(const StringView &name);
+      StringView getName(uint32_t id) { return names[id]; }
+      size_t size() { return names.size(); }
+    private:
+      uint32_t &findSlot(const StringView &name, uint32_t h);
+      void grow();
+
+      Arena arena;
+      std::vector<StringView> names;
+      std::vector<uint32_t> hashes;
+      // id + 1 of the name in each slot, 0 = free
+      std::vector<uint32_t> slots;
+    };
+
     //
     // Here are the public interfaces
     //
@@ -101,6 +421,9 @@ namespace gnilk {
     public:
       virtual std::string& getName() = 0;
       virtual std::string& getValue() = 0;
+      // Views never allocate, in zero-copy mode they point straight into the parsed data
+      virtual StringView getNameView() = 0;
+      virtual StringView getValueView() = 0;
     };
 
     class ITag {
@@ -108,18 +431,26 @@ namespace gnilk {
       virtual bool hasContent() = 0;
       virtual std::string &getName() = 0;
       virtual std::string &getContent() = 0;
+      virtual StringView getNameView() = 0;
+      virtual StringView getContentView() = 0;
 
       virtual std::string toString() = 0;
+      // True for tags read from '<?name ...?>', e.g. the '<?xml ...?>' declaration
+      virtual bool isInstruction() = 0;
 
-      virtual bool hasAttribute(std::string name) = 0;
-      virtual std::string getAttributeValue(std::string name, std::string defValue) = 0;
+      // Lookups take views so both 'const char *' and std::string can be passed without copying
+      virtual bool hasAttribute(const StringView &name) = 0;
+      virtual std::string getAttributeValue(const StringView &name, std::string defValue) = 0;
+      virtual IAttribute *getAttribute(const StringView &name) = 0;
 
 
       virtual std::list<IAttribute *> &getAttributes() = 0;
       virtual std::list<ITag *> &getChildren() = 0;
       virtual ITag *getParent() = 0;
-      virtual ITag *getFirstChild(std::string name) = 0;
-      virtual ITag *getChildWithAttributeValue(std::string name, std::string attribute, std::string value) = 0;
+      virtual ITag *getFirstChild(const StringView &name) = 0;
+      // Appends all children called 'name' to 'result', in document order
+      virtual void findChildren(const StringView &name, std::vector<ITag *> &result) = 0;
+      virtual ITag *getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value) = 0;
     };
 
     typedef std::function<void(ITag *tag, std::list<IAttribute *>&attributes)> OnTagDelegate;
@@ -137,60 +468,170 @@ namespace gnilk {
       virtual void StartTag(ITag *pTag) = 0;
       virtual void EndTag(ITag *pTag) = 0;
       virtual void ContentTag(ITag *pTag, const std::string &content) = 0;
+      // Called after StartTag, return true to skip everything up to the end tag.
+      // The parser only counts the nesting of a skipped subtree, no tags are created and no events fire
+      // until EndTag of this tag. Content of the tag itself is dropped as well.
+      virtual bool SkipSubtree(ITag *) { return false; }
     };
 
     //
     // internal parser classes here and default implementations of said interfaces
     //
 
+    //
+    // Name/Value (and Name/Content for tags) are either owned strings or views into the parsed data.
+    // A view is materialized into the string on first call to the string getter.
+    //
     class Attribute : public IAttribute {
     private:
       std::string name;
       std::string value;
+      StringView nameView;
+      StringView valueView;
+      Attribute *next;
+      uint32_t nameId;
+      uint32_t nsId;
+      uint32_t localId;
     public:
-      Attribute() {}
-      virtual std::string &getName() { return name; }
-      void setName(std::string &_name) { name = _name; }
+      Attribute() { next = NULL; nameId = nsId = localId = NAME_NONE; }
+      virtual ~Attribute() {}
+      Attribute *getNext() { return next; }
+      void setNext(Attribute *_next) { next = _next; }
+      virtual std::string &getName() {
+        if (name.empty() && !nameView.empty()) name.assign(nameView.data(), nameView.length());
+        return name;
+      }
+      void setName(const std::string &_name) { name = _name; nameView = StringView(); }
+      void setNameView(const StringView &_name) { name.clear(); nameView = _name; }
+      virtual StringView getNameView() { return nameView.empty()?StringView(name):nameView; }
 
-      virtual std::string& getValue() { return value; }
-      void setValue(std::string &_value) {value = _value; }
+      virtual std::string& getValue() {
+        if (value.empty() && !valueView.empty()) value.assign(valueView.data(), valueView.length());
+        return value;
+      }
+      void setValue(const std::string &_value) {value = _value; valueView = StringView(); }
+      void setValue(const char *_value, size_t len) { value.assign(_value, len); valueView = StringView(); }
+      void setValueView(const StringView &_value) { value.clear(); valueView = _value; }
+      virtual StringView getValueView() { return valueView.empty()?StringView(value):valueView; }
+
+      // Name as an id in the name table of the document (or stream parser), NAME_NONE if not interned
+      uint32_t getNameId() { return nameId; }
+      void setNameId(uint32_t _nameId) { nameId = _nameId; }
+      // With pfNamespaces, the namespace URI (0 = none) and local name as ids in the name table, else NAME_NONE
+      uint32_t getNamespaceId() { return nsId; }
+      uint32_t getLocalNameId() { return localId; }
+      void setNamespace(uint32_t _nsId, uint32_t _localId) { nsId = _nsId; localId = _localId; }
     };
 
     class Tag : public ITag {
     private:
       std::string name;
       std::string content;
-
+      StringView nameView;
+      StringView contentView;
+
+      // Children and attributes are intrusive lists, nothing is allocated per child or attribute.
+      // The std::list versions are only built when someone asks for them.
+      Tag *firstChild;
+      Tag *lastChild;
+      Tag *nextSibling;
+      Attribute *firstAttribute;
+      Attribute *lastAttribute;
+      // attributes kept by 'clear' for reuse
+      Attribute *freeAttributes;
       std::list<IAttribute *> attributes;
       std::list<ITag *>children;
+      bool attributeListValid;
+      bool childListValid;
       Tag *parent;
+      // Attributes are allocated here, when NULL they are heap allocated and owned by the tag
+      Arena *pArena;
+      // Name lookup index, built on first lookup when there are enough children/attributes
+      struct LookupIndex {
+        NameIndex<Tag> children;
+        NameIndex<Attribute> attributes;
+        bool childrenValid;
+        bool attributesValid;
+      };
+      LookupIndex *pIndex;
+      uint32_t numChildren;
+      uint32_t numAttributes;
+      uint32_t nameId;
+      uint32_t nsId;
+      uint32_t localId;
+      // namespace bindings in the parser before the ones declared here, dropped when the tag closes
+      uint32_t nsScope;
+      bool instruction;
+      LookupIndex *getIndex();
+      void linkAttribute(Attribute *attr);
+      Attribute *allocAttribute();
+      void deleteAttributes(Attribute *attr);
     public:
+      Tag();
       Tag(std::string _name);
+      Tag(Arena *_pArena);
       virtual ~Tag();
 
       virtual bool hasContent();
       virtual std::string toString();
+      virtual bool isInstruction() { return instruction; }
+      void setInstruction(bool _instruction) { instruction = _instruction; }
+      void clear();
 
-      void addAttribute(std::string _name, std::string _value);
+      void addAttribute(const std::string &_name, const std::string &_value);
+      Attribute *addAttributeView(const StringView &_name, const StringView &_value);
       void addChild(Tag *tag);
 
       void setParent(Tag *tag);
       ITag *getParent();
 
-      virtual std::string &getName() { return name; }
-      void setName(std::string &_name) { name = _name; }
-
-      virtual std::string &getContent() { return content; }
-      void setContent(std::string &_content) { content = _content; }
-
-      bool hasAttribute(std::string name);
-      std::string getAttributeValue(std::string name, std::string defValue);
-
+      virtual std::string &getName() {
+        if (name.empty() && !nameView.empty()) name.assign(nameView.data(), nameView.length());
+        return name;
+      }
+      void setName(const std::string &_name) { name = _name; nameView = StringView(); }
+      void setNameView(const StringView &_name) { name.clear(); nameView = _name; }
+      virtual StringView getNameView() { return nameView.empty()?StringView(name):nameView; }
 
-      virtual std::list<IAttribute *> &getAttributes() { return attributes; }
-      virtual std::list<ITag *> &getChildren() { return children; }
-      virtual ITag *getFirstChild(std::string name);
-      virtual ITag *getChildWithAttributeValue(std::string name, std::string attribute, std::string value);
+      virtual std::string &getContent() {
+        if (content.empty() && !contentView.empty()) content.assign(contentView.data(), contentView.length());
+        return content;
+      }
+      void setContent(const std::string &_content) { content = _content; contentView = StringView(); }
+      void setContent(const char *_content, size_t len) { content.assign(_content, len); contentView = StringView(); }
+      void setContentView(const StringView &_content) { content.clear(); contentView = _content; }
+      virtual StringView getContentView() { return contentView.empty()?StringView(content):contentView; }
+
+      virtual bool hasAttribute(const StringView &name);
+      virtual std::string getAttributeValue(const StringView &name, std::string defValue);
+      virtual IAttribute *getAttribute(const StringView &name);
+
+
+      virtual std::list<IAttribute *> &getAttributes();
+      virtual std::list<ITag *> &getChildren();
+      Tag *getFirstChildTag() { return firstChild; }
+      Tag *getNextSibling() { return nextSibling; }
+      Attribute *getFirstAttribute() { return firstAttribute; }
+      virtual ITag *getFirstChild(const StringView &name);
+      virtual void findChildren(const StringView &name, std::vector<ITag *> &result);
+      virtual ITag *getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value);
+
+      Tag *findChild(const StringView &name);
+      Attribute *findAttribute(const StringView &name);
+
+      // Name as an id in the name table of the document (or stream parser), NAME_NONE if not interned.
+      // With pfNamespaces, the namespace URI (0 = none) and local name as ids in the name table, else NAME_NONE.
+      // Not part of ITag since the flat and lazy documents don't intern names, the lookups compare integers only.
+      uint32_t getNameId() { return nameId; }
+      void setNameId(uint32_t _nameId) { nameId = _nameId; }
+      Tag *getFirstChild(uint32_t nameId);
+      uint32_t getNamespaceId() { return nsId; }
+      uint32_t getLocalNameId() { return localId; }
+      Tag *getFirstChild(uint32_t nsId, uint32_t localId);
+      Attribute *getAttribute(uint32_t nsId, uint32_t localId);
+      void setNamespace(uint32_t _nsId, uint32_t _localId) { nsId = _nsId; localId = _localId; }
+      uint32_t getNamespaceScope() { return nsScope; }
+      void setNamespaceScope(uint32_t scope) { nsScope = scope; }
     };
 
 
@@ -198,16 +639,35 @@ namespace gnilk {
     // - TODO: Keep <?xml > strings in separate tag lists
     class Document : public IDocument {
       Tag *root;
+      // Owns the parsed data when tags are views into it (zero-copy mode)
+      std::string sourceData;
+      MappedFile *pSourceFile;
+      // All tags and attributes of the tree, released in one go with the document
+      Arena arena;
+      // Documents parsed in parallel, their tags have been moved into this tree
+      std::vector<Document *> fragments;
+      // Tag and attribute names (and namespace ids), kept by 'reset' so ids stay the same across reuse
+      NameTable names;
 
     public:
       Document();
       virtual ~Document();
+      void reset();
 
       //public std::string &getData() { return data; };
       virtual ITag *getRoot() { return root; };
       virtual void traverse(OnTagDelegate startHandler, OnTagDelegate endHandler);
       virtual void traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler);
       void setRoot(Tag *pRoot) { root = pRoot; }
+      std::string &getSourceData() { return sourceData; }
+      // Takes ownership of the file, tags parsed in zero-copy mode reference it
+      void setSourceFile(MappedFile *pFile) { pSourceFile = pFile; }
+      MappedFile *releaseSourceFile() { MappedFile *pFile = pSourceFile; pSourceFile = NULL; return pFile; }
+      Arena &getArena() { return arena; }
+      Tag *createTag() { return arena.create<Tag>(&arena); }
+      NameTable &getNames() { return names; }
+      // Keeps another document alive as long as this one, used when tags are moved over from it
+      void adoptFragment(Document *pFragment) { fragments.push_back(pFragment); }
       void dumpTagTree(ITag *root, int depth);
 
 
@@ -219,25 +679,504 @@ namespace gnilk {
       std::string indentString(int depth);
     };
 
+    //
+    // Compact document, all nodes are stored in one vector in document order (node 0 is the root).
+    // Tree links are indices, attributes of a node are a range in a side vector.
+    // Names and content are views into the data owned by the document.
+    //
+    #define FLAT_NONE (0xffffffff)
+
+    struct FlatNode {
+      StringView name;
+      StringView content;
+      uint32_t parent;
+      uint32_t firstChild;
+      uint32_t nextSibling;
+      uint32_t firstAttribute;
+      uint32_t numAttributes;
+      bool instruction;
+    };
+
+    struct FlatAttribute {
+      StringView name;
+      StringView value;
+    };
+
+    class FlatDocument;
+
+    // ITag facade for a flat node, created on first request
+    class FlatTag : public ITag {
+    public:
+      FlatTag(FlatDocument *_pDoc, uint32_t _index);
+
+      uint32_t getIndex() { return index; }
+
+      virtual bool hasContent();
+      virtual std::string &getName();
+      virtual std::string &getContent();
+      virtual StringView getNameView();
+      virtual StringView getContentView();
+
+      virtual std::string toString();
+      virtual bool isInstruction();
+
+      virtual bool hasAttribute(const StringView &name);
+      virtual std::string getAttributeValue(const StringView &name, std::string defValue);
+      virtual IAttribute *getAttribute(const StringView &name);
+
+      virtual std::list<IAttribute *> &getAttributes();
+      virtual std::list<ITag *> &getChildren();
+      virtual ITag *getParent();
+      virtual ITag *getFirstChild(const StringView &name);
+      virtual void findChildren(const StringView &name, std::vector<ITag *> &result);
+      virtual ITag *getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value);
+    private:
+      const FlatNode &node();
+    private:
+      FlatDocument *pDoc;
+      uint32_t index;
+      // materialized on request
+      std::string name;
+      std::string content;
+      std::list<IAttribute *> attributes;
+      std::list<ITag *> children;
+      bool attributeListValid;
+      bool childListValid;
+    };
+
+    class FlatDocument : public IDocument {
+      friend class FlatDocumentBuilder;
+    public:
+      FlatDocument();
+      virtual ~FlatDocument();
+
+      // Takes over the source data (or file) of a zero-copy document and flattens the tree
+      void build(Document *pSource);
+
+      virtual ITag *getRoot() { return getTag(0); }
+      virtual void traverse(OnTagDelegate startHandler, OnTagDelegate endHandler);
+      virtual void traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler);
+
+      std::string &getSourceData() { return sourceData; }
+      void setSourceFile(MappedFile *pFile) { delete pSourceFile; pSourceFile = pFile; }
+
+      // Direct access to the compact representation
+      size_t getNodeCount() { return nodes.size(); }
+      const FlatNode &getNode(uint32_t idx) { return nodes[idx]; }
+      const FlatAttribute &getAttribute(uint32_t idx) { return attributes[idx]; }
+      uint32_t findChild(uint32_t idxParent, const StringView &name);
+      const FlatAttribute *findAttribute(uint32_t idxNode, const StringView &name);
+
+      // Facades
+      ITag *getTag(uint32_t idx);
+      IAttribute *getAttributeFacade(uint32_t idx);
+    private:
+      void flatten(Tag *root, const char *oldBase, size_t szOld);
+      uint32_t appendNode(Tag *tag, uint32_t idxParent, const char *oldBase, size_t szOld);
+      StringView rebase(const StringView &view, const char *oldBase, size_t szOld);
+      void traverseNodes(OnTagDelegate startHandler, OnTagDelegate endHandler, uint32_t idxParent);
+    private:
+      std::vector<FlatNode> nodes;
+      std::vector<FlatAttribute> attributes;
+      std::vector<FlatTag *> tags;
+      std::vector<Attribute *> attributeFacades;
+      std::string sourceData;
+      MappedFile *pSourceFile;
+      // facades live here
+      Arena arena;
+    };
+
+    //
+    // Parser core sink building a flat document straight from the data, the data must be owned by the document
+    //
+    class FlatDocumentBuilder {
+    public:
+      FlatDocumentBuilder(FlatDocument *_pDoc, IParseEvents *_pEventHandler, int flags = 0);
+
+      void onTagStart(const StringView &name);
+      void onInstructionStart(const StringView &name);
+      void onAttribute(const StringView &name, const StringView &value);
+      bool onTagCommit();
+      void onContent(const StringView &content);
+      void onTagEnd(const StringView &name);
+    private:
+      StringView decodeText(const StringView &text);
+
+      FlatDocument *pDoc;
+      IParseEvents *pEventHandler;
+      bool bCaseSensitive;
+      uint32_t idxCurrent;
+      // open nodes and the last child of each
+      std::vector<uint32_t> stack;
+      std::vector<uint32_t> lastChild;
+    };
+
+    //
+    // Lazy document, loading only builds a structural index of where the elements are in the data.
+    // Attributes are parsed from the start tag and content is decoded when first asked for, the tag
+    // facades are created on request. A large document of which little is touched costs one scan.
+    //
+    struct LazyNode {
+      StringView name;
+      StringView content;   // as it is in the data, decoded on request
+      size_t start;         // offset of the start tag
+      size_t contentStart;  // offset past the start tag, the attributes are parsed from [start, contentStart)
+      size_t end;           // offset past the end tag (the end of the data for unclosed tags)
+      uint32_t depth;
+      uint32_t parent;
+      uint32_t firstChild;
+      uint32_t nextSibling;
+    };
+
+    class LazyDocument;
+
+    // ITag facade for a lazy node, created on first request
+    class LazyTag : public ITag {
+    public:
+      LazyTag(LazyDocument *_pDoc, uint32_t _index);
+
+      uint32_t getIndex() { return index; }
+
+      virtual bool hasContent();
+      virtual std::string &getName();
+      virtual std::string &getContent();
+      virtual StringView getNameView();
+      virtual StringView getContentView();
+
+      virtual std::string toString();
+      virtual bool isInstruction();
+
+      virtual bool hasAttribute(const StringView &name);
+      virtual std::string getAttributeValue(const StringView &name, std::string defValue);
+      virtual IAttribute *getAttribute(const StringView &name);
+
+      virtual std::list<IAttribute *> &getAttributes();
+      virtual std::list<ITag *> &getChildren();
+      virtual ITag *getParent();
+      virtual ITag *getFirstChild(const StringView &name);
+      virtual void findChildren(const StringView &name, std::vector<ITag *> &result);
+      virtual ITag *getChildWithAttributeValue(const StringView &name, const StringView &attribute, const StringView &value);
+    private:
+      const LazyNode &node();
+      Attribute *getFirstAttribute();
+      Attribute *findAttribute(const StringView &name);
+    private:
+      LazyDocument *pDoc;
+      uint32_t index;
+      // materialized on request
+      Attribute *firstAttribute;
+      StringView contentView;
+      std::string name;
+      std::string content;
+      std::list<IAttribute *> attributes;
+      std::list<ITag *> children;
+      bool attributesParsed;
+      bool contentDecoded;
+      bool attributeListValid;
+      bool childListValid;
+    };
+
+    class LazyDocument : public IDocument {
+      friend class LazyDocumentBuilder;
+      friend class LazyTag;
+      friend class Parser;
+    public:
+      LazyDocument(int _flags = 0);
+      virtual ~LazyDocument();
+
+      virtual ITag *getRoot() { return getTag(0); }
+      virtual void traverse(OnTagDelegate startHandler, OnTagDelegate endHandler);
+      virtual void traverseFromNode(ITag *node, OnTagDelegate startHandler, OnTagDelegate endHandler);
+
+      std::string &getSourceData() { return sourceData; }
+      void setSourceFile(MappedFile *pFile) { delete pSourceFile; pSourceFile = pFile; }
+      const char *getData() { return pData; }
+      size_t getDataSize() { return szData; }
+
+      // Writes the structural index, the interned names and the attribute spans to a file which
+      // Parser::loadIndexedFile maps instead of parsing the data again. Returns false on write errors.
+      bool saveIndex(const std::string &filename);
+
+      // Direct access to the structural index
+      size_t getNodeCount() { return nodes.size(); }
+      const LazyNode &getNode(uint32_t idx) { return nodes[idx]; }
+      uint32_t findChild(uint32_t idxParent, const StringView &name);
+
+      // Facade of a node, nothing but the facade is materialized
+      ITag *getTag(uint32_t idx);
+      // Number of facades with their attributes parsed
+      size_t getMaterializedCount() { return numMaterialized; }
+    private:
+      bool readIndex(const std::string &filename);
+      void readIndexAttributes(uint32_t idx, std::vector<FlatAttribute> &result);
+      void collectAttributes(uint32_t idx, std::vector<FlatAttribute> &result);
+      Attribute *parseAttributes(uint32_t idx);
+      StringView decodeText(const StringView &text);
+      void traverseNodes(OnTagDelegate startHandler, OnTagDelegate endHandler, uint32_t idxParent);
+    private:
+      std::vector<LazyNode> nodes;
+      std::vector<LazyTag *> tags;
+      std::string sourceData;
+      MappedFile *pSourceFile;
+      MappedFile *pIndexFile;
+      const char *pData;
+      size_t szData;
+      int flags;
+      size_t numMaterialized;
+      // Loaded from an index the attributes of node i are encoded in [attributeOffsets[i], attributeOffsets[i+1])
+      // of the attribute section, without an index the start tag is parsed
+      const char *pAttributeIndex;
+      std::vector<size_t> attributeOffsets;
+      std::vector<StringView> indexNames;
+      std::vector<FlatAttribute> scratch;
+      // facades, attributes and decoded text live here
+      Arena arena;
+    };
+
+    struct MemorySource;
+    template<typename TSource, typename TSink> class ParserCore;
+
+    //
+    // Parser core sink recording the structural index of a lazy document, the attributes are skipped
+    //
+    class LazyDocumentBuilder {
+    public:
+      typedef ParserCore<MemorySource, LazyDocumentBuilder> Core;
+
+      LazyDocumentBuilder(LazyDocument *_pDoc, const char *pData, size_t szData, int flags);
+      // The core reports where the tags are
+      void setCore(Core *_pCore) { pCore = _pCore; }
+
+      void onTagStart(const StringView &name);
+      __inline void onInstructionStart(const StringView &name) { onTagStart(name); }
+      __inline void onAttribute(const StringView &, const StringView &) {}
+      bool onTagCommit();
+      void onContent(const StringView &content);
+      void onTagEnd(const StringView &name);
+      // Tags still open at the end of the data are closed there
+      void finish(size_t szData);
+    private:
+      LazyDocument *pDoc;
+      Core *pCore;
+      bool bCaseSensitive;
+      uint32_t idxCurrent;
+      // open nodes and the last child of each
+      std::vector<uint32_t> stack;
+      std::vector<uint32_t> lastChild;
+    };
+
     //
     // TODO: Break this out to 'xmlutils.h/cpp'
     //
     #define DOCPATH_DEFAULT_SEPARATOR (".")
 
+    //
+    // Path query, compiled once and evaluated any number of times.
+    // A path is a list of steps separated by the separator, e.g. 'component.SetupUILanguage.UILanguage'.
+    // A step is a tag name or '*' (any tag) followed by optional predicates:
+    //   [@attr]          the tag has the attribute
+    //   [@attr=value]    the attribute has the value, the value may be quoted with ' or "
+    //   [.=value]        the tag content is the value
+    // Evaluation only descends into matching children (through the tag lookup index).
+    // A compiled path isn't changed by evaluating it, the scratch space is local to each call.
+    //
     class DocPath {
+      friend class PathExtractor;
     public:
       DocPath();
       DocPath(std::string separator);
 
+      // Returns false if the path is malformed, nothing matches an invalid path
+      bool compile(const std::string &path);
+      bool isValid() { return valid; }
+
+      // Paths are relative to the given tag, for documents they start at the top level tags
+      ITag *findFirst(ITag *from);
+      ITag *findFirst(IDocument *doc) { return findFirst(doc->getRoot()); }
+      size_t findAll(ITag *from, std::vector<ITag *> &result);
+      size_t findAll(IDocument *doc, std::vector<ITag *> &result) { return findAll(doc->getRoot(), result); }
+
+      // Returns the first tag anywhere in the document with the name and content
       ITag *findFirst(Document *doc, std::string tag, std::string value);
     private:
-      void onDefinitionTagDataStart(ITag *tag, std::list<IAttribute *>&attributes);
-      void onDefinitionTagDataEnd(ITag *tag, std::list<IAttribute *>&attributes);
- 
+      struct Predicate {
+        bool content;       // [.=value]
+        bool hasValue;
+        std::string name;
+        std::string value;
+      };
+      struct Step {
+        bool wildcard;
+        std::string name;
+        std::vector<Predicate> predicates;
+      };
+      bool compileStep(const std::string &text, Step &step);
+      bool matches(ITag *tag, const Step &step, bool checkContent = true);
+      typedef std::vector<std::vector<ITag *> > Candidates;
+      bool evaluate(ITag *node, size_t idxStep, Candidates &candidates, std::vector<ITag *> *pResult, ITag **ppFirst);
+      ITag *findTag(ITag *node, const std::string &tag, const std::string &value);
+
       std::string pathSeparator;
-      ITag *findResult;
-      std::string searchTag;
-      std::string searchValue;
+      std::vector<Step> steps;
+      bool valid;
+    };
+
+    typedef std::function<void(DocPath *query, ITag *tag)> OnPathMatchDelegate;
+
+    //
+    // Matches a set of queries while parsing, use it as the event handler in stream mode and
+    // no document is built. A stack of the queries still alive at each open tag is kept, so each
+    // tag is only tested against the queries matching its parent.
+    // Matches are reported when the tag ends, with content and attributes in place.
+    // Content predicates ([.=value]) are only checked on the last step.
+    //
+    class PathExtractor : public IParseEvents {
+    public:
+      PathExtractor();
+
+      // The query must be compiled and outlive the extractor
+      void add(DocPath *query, OnPathMatchDelegate onMatch);
+      // Call before parsing another document, if the previous one was broken off
+      void reset();
+
+      virtual void StartTag(ITag *pTag);
+      virtual void EndTag(ITag *pTag);
+      virtual void ContentTag(ITag *, const std::string &) {}
+      // Subtrees where no query can match are skipped
+      virtual bool SkipSubtree(ITag *pTag);
+    private:
+      struct Query {
+        DocPath *path;
+        OnPathMatchDelegate onMatch;
+      };
+      bool matchStep(uint32_t idxQuery, ITag *pTag, size_t depth);
+
+      std::vector<Query> queries;
+      // indices of the live queries for all open tags, 'frames' holds where each tag starts
+      std::vector<uint32_t> live;
+      std::vector<size_t> frames;
+    };
+
+    //
+    // Receives the output of a writer in chunks
+    //
+    class IOutputSink {
+    public:
+      virtual void write(const char *data, size_t len) = 0;
+    };
+
+    class FileOutputSink : public IOutputSink {
+    public:
+      FileOutputSink(FILE *f) : f(f) {}
+      virtual void write(const char *data, size_t len) { fwrite(data, 1, len, f); }
+    private:
+      FILE *f;
+    };
+
+    //
+    // Growable output buffer. Without a sink everything is kept in the buffer, 'clear' makes it ready
+    // for reuse with the memory kept. With a sink the data is handed over in XML_PARSER_WRITE_BUFFER chunks.
+    //
+    class OutputBuffer {
+    public:
+      OutputBuffer(IOutputSink *pSink = NULL) : pSink(pSink) {}
+      ~OutputBuffer() { flush(); }
+
+      __inline void put(char c) {
+        data.push_back(c);
+        if ((pSink != NULL) && (data.length() >= XML_PARSER_WRITE_BUFFER)) flush();
+      }
+      __inline void put(const char *s, size_t len) {
+        data.append(s, len);
+        if ((pSink != NULL) && (data.length() >= XML_PARSER_WRITE_BUFFER)) flush();
+      }
+      __inline void put(const StringView &s) { put(s.data(), s.length()); }
+      void putEscaped(const StringView &s, bool inAttribute);
+      void putIndent(size_t n);
+      // Hands buffered data to the sink, without a sink this does nothing
+      void flush();
+      void clear() { data.clear(); }
+
+      const std::string &getData() { return data; }
+      StringView view() { return StringView(data.data(), data.length()); }
+    private:
+      IOutputSink *pSink;
+      std::string data;
+    };
+
+    enum kWriteFlags {
+      wfNone = 0,
+      wfPretty = 1,   // one tag per line, indented
+    };
+
+    //
+    // Serializes a document, or a subtree, back to XML. Compact output has no white space between tags.
+    // Tags keep a single content, it's written before the children.
+    //
+    class DocumentWriter {
+    public:
+      DocumentWriter(OutputBuffer &out, int flags = wfNone, size_t indent = 2);
+
+      // The children of the root, tags read from '<?name ..?>' are written back as processing instructions
+      void write(IDocument *pDoc);
+      void write(ITag *pTag);
+
+      static std::string toString(IDocument *pDoc, int flags = wfNone);
+      static std::string toString(ITag *pTag, int flags = wfNone);
+    private:
+      struct WriteFrame {
+        ITag *pTag;
+        std::list<ITag *>::iterator it;
+        std::list<ITag *>::iterator end;
+        WriteFrame(ITag *_pTag) : pTag(_pTag), it(_pTag->getChildren().begin()), end(_pTag->getChildren().end()) {}
+      };
+      void writeTag(ITag *pTag);
+      bool writeStart(ITag *pTag, size_t depth);
+      void writeEnd(ITag *pTag, size_t depth);
+      void writeAttributes(ITag *pTag);
+      void newLine();
+
+      OutputBuffer &out;
+      int flags;
+      size_t indent;
+    };
+
+    //
+    // Push style writer for generating documents, nothing but the names of the open elements is kept.
+    // Attributes go right after 'startElement', calls out of place are ignored and return false.
+    // In pretty mode elements with text are kept on one line so the text isn't changed.
+    //
+    class XmlWriter {
+    public:
+      XmlWriter(OutputBuffer &out, int flags = wfNone, size_t indent = 2);
+
+      void declaration(const StringView &encoding = StringView("utf-8"));
+      void startElement(const StringView &name);
+      bool attribute(const StringView &name, const StringView &value);
+      bool text(const StringView &content);
+      void comment(const StringView &content);
+      bool endElement();
+      // Closes all open elements and flushes the output
+      void finish();
+
+      size_t getDepth() { return frames.size(); }
+    private:
+      struct Frame {
+        size_t nameStart;
+        bool hasChildren;
+        bool hasText;
+      };
+      void closeStartTag();
+      void beginLine();
+
+      OutputBuffer &out;
+      int flags;
+      size_t indent;
+      bool tagOpen;       // '<name' written, attributes can still be added
+      bool needNewLine;
+      // names of the open elements back to back
+      std::string names;
+      std::vector<Frame> frames;
     };
 
     enum kParseState {
@@ -251,11 +1190,161 @@ namespace gnilk {
       psCommentStart,
       psCommentConsume,
       psDocType,
+      // skipping a subtree
+      psSkipContent,
+      psSkipTag,
+      psSkipEndTag,
+      psSkipMarkup,
     };
     enum kParseMode {
       pmStream,
       pmDOMBuild,
     };
+    // Bit flags, combine with '|'
+    enum kParseFlags {
+      pfNone = 0,
+      pfZeroCopy = 1,     // names, attribute values and content are views into the data owned by the Document
+      pfStream = 2,       // only fire events, no document is built (see Parser::streamXML)
+      pfRawText = 4,      // attribute values and content are kept as they are, entities are not decoded
+      pfValidateUTF8 = 8, // input that isn't valid UTF-8 is not parsed (see Parser::hasInvalidUTF8)
+      pfNamespaces = 16,  // resolve namespaces, tags and attributes get namespace/local name ids
+      pfCaseSensitive = 32, // end tags must match the start tag exactly, by default the case is ignored
+    };
+
+    //
+    // Current token while parsing, tracked as a range in the data instead of appending char by char.
+    // Characters skipped in the middle of a token (white space) end up in the range, trim takes care of the ends.
+    //
+    struct ParseToken {
+      size_t start;
+      size_t end;
+
+      ParseToken() : start(0), end(0) {}
+      __inline void reset() { start = end = 0; }
+      __inline bool empty() const { return (start == end); }
+      __inline void add(size_t idx) {
+        if (start == end) start = idx;
+        end = idx + 1;
+      }
+      __inline StringView view(const char *data) const { return StringView(data + start, end - start); }
+      // the data in front of the token was dropped
+      __inline void shift(size_t n) {
+        if (empty()) { reset(); return; }
+        start -= n;
+        end -= n;
+      }
+    };
+
+    //
+    // Input sources for the parser core, 'isComplete' is false while more data can arrive
+    //
+    struct MemorySource {
+      const char *pData;
+      size_t szData;
+
+      MemorySource(const char *_pData, size_t _szData) : pData(_pData), szData(_szData) {}
+      __inline bool isComplete() const { return true; }
+    };
+
+    struct ChunkSource {
+      const char *pData;
+      size_t szData;
+      bool bComplete;
+
+      ChunkSource() : pData(""), szData(0), bComplete(false) {}
+      __inline bool isComplete() const { return bComplete; }
+    };
+
+    //
+    // The parser state machine. Source and sink are template parameters so there are no virtual
+    // calls on the per-byte path, the sink is called once per tag, attribute and content.
+    //
+    // A sink implements:
+    //   onTagStart(const StringView &name)     - name of a new tag
+    //   onInstructionStart(const StringView &name) - name of a new '<?name' tag, closed by '?>'
+    //   onAttribute(const StringView &name, const StringView &value)
+    //   onTagCommit()                          - start tag is complete
+    //   onContent(const StringView &content)   - trimmed content of the last committed tag
+    //   onTagEnd(const StringView &name)       - end tag, name is empty for '<tag a="b"/>'
+    //
+    template<typename TSource, typename TSink>
+    class ParserCore {
+    public:
+      ParserCore(TSource &_source, TSink &_sink) : source(_source), sink(_sink) {
+        reset();
+      }
+      void reset() {
+        state = psConsume;
+        idx = 0;
+        tagStart = 0;
+        token.reset();
+        attrName.reset();
+        commentDash = false;
+        skipDepth = 0;
+        skipSlash = false;
+        skipQuote = false;
+      }
+      // Runs as far as the source allows, can be called again when the source has grown
+      void parse();
+
+      kParseState getState() { return state; }
+      size_t getPosition() { return idx; }
+      // Offset of the '<' of the last tag seen
+      size_t getTagStart() { return tagStart; }
+      // True when the next '<' starts a new tag and no content is pending
+      bool isBetweenTags() { return (state == psConsume) || ((state == psTagContent) && trimmedToken().empty()); }
+      // Continues at 'pos' between tags, used to step over data parsed elsewhere
+      void seek(size_t pos) {
+        state = psConsume;
+        idx = pos;
+        token.reset();
+      }
+      // Push parsing, what must be kept of the source and moving the state when the front is dropped
+      size_t getKeepFrom();
+      void shift(size_t n);
+    private:
+      // In push mode the lookahead char is needed before a char can be handled
+      __inline bool hasData() {
+        if (idx >= source.szData) return false;
+        return (source.isComplete() || ((idx + 1) < source.szData));
+      }
+      __inline int peek() {
+        if (idx >= source.szData) return EOF;
+        return source.pData[idx];
+      }
+      // Bulk consume a run of chars, the token (if any) is extended over the run
+      __inline void skipTo(ParseToken *pToken, char stop) {
+        size_t idxStop = XmlScan::findChar(source.pData, idx, source.szData, stop);
+        if ((pToken != NULL) && (idxStop > idx)) pToken->add(idxStop - 1);
+        idx = idxStop;
+      }
+      __inline void skipName() {
+        size_t idxStop = XmlScan::findNameEnd(source.pData, idx, source.szData);
+        if (idxStop > idx) token.add(idxStop - 1);
+        idx = idxStop;
+      }
+      __inline StringView trimmedToken() {
+        return StringUtilStatic::trim(token.view(source.pData));
+      }
+      __inline kParseState beginContent(bool skip) {
+        if (!skip) return psTagContent;
+        skipDepth = 1;
+        return psSkipContent;
+      }
+    private:
+      TSource &source;
+      TSink &sink;
+      kParseState state;
+      size_t idx;
+      size_t tagStart;
+      ParseToken token;
+      ParseToken attrName;
+      bool commentDash;
+      // Subtree skipping, the sink returns true from 'onTagCommit' to skip the children of a tag
+      size_t skipDepth;
+      bool skipSlash;
+      bool skipQuote;
+    };
 
     //
     // Had to do this in order to try out a few things without to much changes
@@ -288,26 +1377,101 @@ namespace gnilk {
     public:
       Parser(std::string _data);
       Parser(std::string _data, IParseEvents *pEventHandler);
+      Parser(std::string _data, IParseEvents *pEventHandler, int flags);
+      // Long lived parser, documents are given with 'parse' or pushed with 'feed' and 'finish'.
+      // Push parsing always copies strings (pfZeroCopy is ignored) as the feed buffer is reused.
+      Parser(IParseEvents *pEventHandler, int flags = pfNone);
       virtual ~Parser();
 
-      static Document *loadXML(std::string _data, IParseEvents *pEventHandler = NULL);
+      void feed(const char *chunk, size_t len);
+      void finish();
+      // Parses a complete document, the previous one is reset and reused (tags, stack and arena blocks are kept warm,
+      // only the child list nodes are allocated again).
+      // In zero-copy mode the document references 'input'. As always the parser never deletes the document,
+      // delete it when done or 'releaseDocument' it to keep it and have the next parse start a new one.
+      Document *parse(const StringView &input);
+      // Readies the parser for the next document, also after a broken off push parse
+      void reset();
+      Document *releaseDocument() { Document *pDoc = pDocument; pDocument = NULL; return pDoc; }
+      // With pfValidateUTF8, true if the input was rejected. Pushed data is parsed up to the bad chunk.
+      bool hasInvalidUTF8() { return invalidUTF8; }
+      // Table of the name (and namespace) ids, the document's in DOM mode
+      NameTable *getNameTable() { return pNames; }
+
+      // The loaders return NULL (or false) for input failing pfValidateUTF8
+      static Document *loadXML(std::string _data, IParseEvents *pEventHandler = NULL, int flags = pfNone);
+      // For large documents with long runs of records below the root element. The records are split
+      // in chunks parsed on 'numThreads' threads (0 = one per core) and stitched together, chunks
+      // not split at a record boundary are parsed again in sequence. No events are fired.
+      static Document *loadXMLParallel(std::string _data, size_t numThreads = 0, int flags = pfNone);
+      // Of the flags only pfCaseSensitive applies to flat documents
+      static FlatDocument *loadFlatXML(std::string _data, IParseEvents *pEventHandler = NULL, int flags = pfNone);
+      // Only the structure is indexed, see LazyDocument. pfRawText, pfCaseSensitive and pfValidateUTF8 apply.
+      static LazyDocument *loadLazyXML(std::string _data, int flags = pfNone);
+      static LazyDocument *loadLazyFile(const std::string &filename, int flags = pfNone);
+      // Maps the file together with its index (see LazyDocument::saveIndex), nothing is parsed. The index is
+      // only used when it was built with the same flags from data with the same size and content hash,
+      // otherwise the file is loaded lazily and the index written again. Returns NULL like loadLazyFile.
+      static LazyDocument *loadIndexedFile(const std::string &filename, const std::string &indexFilename, int flags = pfNone);
+      // Parses straight from a memory mapped file, returns NULL if the file can't be opened.
+      // With pfZeroCopy the document keeps the mapping and the tags reference it, nothing is copied.
+      static Document *loadFile(const std::string &filename, IParseEvents *pEventHandler = NULL, int flags = pfNone);
+      static FlatDocument *loadFlatFile(const std::string &filename, IParseEvents *pEventHandler = NULL, int flags = pfNone);
+      static bool streamFile(const std::string &filename, IParseEvents *pEventHandler, int flags = pfNone);
+      // SAX style, no tags are kept once closed so memory use is bound by the nesting depth.
+      // In zero-copy mode the views are only valid during the callback.
+      static void streamXML(std::string _data, IParseEvents *pEventHandler, int flags = pfNone);
       Document *getDocument() { return pDocument; }
 
     protected:
-      virtual void initialize(std::string _data, IParseEvents *pEventHandler);
+      virtual void initialize(std::string _data, IParseEvents *pEventHandler, int flags = pfNone);
       virtual void parseData();
       virtual void changeState(kParseState newState);
+      void begin(IParseEvents *pEventHandler, int flags);
+      void restart(Document *pDoc);
+      void parseBuffer(const char *buffer, size_t len);
+      void parseMemory(const char *buffer, size_t len);
+      bool validateChunk(const char *chunk, size_t len);
+      void compact();
+      static Document *parseParallel(std::string &_data, size_t numChunks, int flags);
 
       Tag *createTag(std::string name);
       void endTag(std::string tok);
       void commitTag(Tag *pTag);
 
+      // View based versions, copies or references the data depending on pfZeroCopy
+      Tag *allocTag();
+      Tag *createTag(const StringView &name);
+      void addAttribute(Tag *pTag, const StringView &name, const StringView &value);
+      void setContent(Tag *pTag, const StringView &content);
+      void endTag(const StringView &tok);
+      bool matchEndTag(Tag *pTag, const StringView &tok);
+      StringView decodeText(const StringView &text, bool &bScratch);
+      void resolveNamespaces(Tag *pTag);
+      uint32_t lookupNamespace(const StringView &prefix);
+
       void rewind();
       int nextChar();
       int peekNextChar();
 
       void enterNewState();
 
+      // -- sink interface for the parser core
+      template<typename, typename> friend class ParserCore;
+      friend class BatchParser;
+      __inline void onTagStart(const StringView &name) { tagCurrent = createTag(name); }
+      __inline void onInstructionStart(const StringView &name) {
+        tagCurrent = createTag(name);
+        tagCurrent->setInstruction(true);
+      }
+      __inline void onAttribute(const StringView &name, const StringView &value) { addAttribute(tagCurrent, name, value); }
+      __inline bool onTagCommit() {
+        commitTag(tagCurrent);
+        return ((pEventHandler != NULL) && pEventHandler->SkipSubtree(tagCurrent));
+      }
+      __inline void onContent(const StringView &content) { setContent(tagCurrent, content); }
+      __inline void onTagEnd(const StringView &name) { endTag(name); }
+
 
     protected:
       StringUtil *sUtil;
@@ -316,15 +1480,313 @@ namespace gnilk {
       kParseState state;
       kParseState oldState;
       kParseMode parseMode;
+      int parseFlags;
       std::stack<Tag *> tagStack;
-      int idxCurrent;
+      // closed tags waiting for reuse in stream mode
+      std::vector<Tag *> tagPool;
+      // decoded text on its way to a tag, unless it goes to the document arena
+      std::string decodeBuffer;
+      size_t idxCurrent;
       std::string data;
+      // points to 'data' or, in zero-copy mode, to the data owned by the document
+      const char *pData;
+      size_t szData;
+      // push parsing, the source is 'data'
+      ChunkSource pushSource;
+      ParserCore<ChunkSource, Parser> *pPushCore;
       IParseEvents *pEventHandler;
+      // as given to 'begin', push parsing drops pfZeroCopy
+      int requestedFlags;
+      // set when an end tag didn't match the open tag
+      bool unbalanced;
+      bool invalidUTF8;
+      // namespace prefixes in scope (pfNamespaces), innermost last
+      struct NsBinding {
+        uint32_t prefixId;
+        uint32_t uriId;
+      };
+      std::vector<NsBinding> nsBindings;
+      NameTable *pNames;
+      NameTable streamNames;
+      // start of a UTF-8 sequence split between pushed chunks
+      char utf8Tail[4];
+      size_t szUtf8Tail;
+      // no pushed data is parsed until it's known whether it starts with a BOM
+      bool bomPending;
       // parser variables
       std::string token;
 
     };
 
+    typedef std::function<void(size_t index, Document *pDoc)> OnBatchDocumentDelegate;
+
+    //
+    // Parses many small documents on a pool of threads (the calling thread is one of them).
+    // Each worker keeps its parser, so there is no per-document setup besides the document itself.
+    //
+    class BatchParser {
+    public:
+      // 0 threads = one per core, flags as for Parser::loadXML (pfStream is ignored)
+      BatchParser(size_t numThreads = 0, int flags = pfNone);
+      ~BatchParser();
+
+      size_t getNumThreads() { return workers.size(); }
+      // results[i] is the document for inputs[i], the documents are owned by the caller
+      void parse(const StringView *inputs, size_t count, Document **results);
+      void parse(const std::vector<std::string> &inputs, std::vector<Document *> &results);
+      // Each worker reuses one document, it's only valid during the callback. The callbacks run on
+      // the worker threads in no particular order. In zero-copy mode the inputs are not copied at all.
+      void process(const StringView *inputs, size_t count, OnBatchDocumentDelegate onDocument);
+    private:
+      struct Worker {
+        Parser *pParser;
+        // reused by 'process'
+        Document *pDocument;
+      };
+      struct Pool;
+      void parseDocument(Worker &worker, const StringView &input, Document *pDoc, bool copyData);
+      void run(size_t count, std::function<void(Worker &worker, size_t index)> job);
+
+      int parseFlags;
+      std::vector<Worker> workers;
+      Pool *pPool;
+    };
+
+    template<typename TSource, typename TSink>
+    size_t ParserCore<TSource, TSink>::getKeepFrom() {
+      // two chars before the position are kept so we can step back over '<!'
+      size_t keep = (idx > 2)?(idx - 2):0;
+      if (!token.empty() && (token.start < keep)) keep = token.start;
+      if ((state == psTagAttributeValue) && !attrName.empty() && (attrName.start < keep)) keep = attrName.start;
+      return keep;
+    }
+
+    template<typename TSource, typename TSink>
+    void ParserCore<TSource, TSink>::shift(size_t n) {
+      idx -= n;
+      tagStart = (tagStart > n)?(tagStart - n):0;
+      token.shift(n);
+      attrName.shift(n);
+    }
+
+    template<typename TSource, typename TSink>
+    void ParserCore<TSource, TSink>::parse() {
+      char c;
+      while(hasData()) {
+        c = source.pData[idx++];
+        switch(state) 
+        {
+        case psConsume:
+          // Data outside of tags is dropped, no need to track it
+          if (c=='<') {
+            tagStart = idx - 1;
+            int next = peek();
+            if (next == '/') {		// ? '</' - distinguish between token <  and </
+              idx++; // consume '/'
+              state = psEndTagStart;
+            } else if (next == '!') {
+              // Action tag started <!--
+              idx++;
+              commentDash = false;
+              state = psCommentStart;
+            } else if (next == '?') {
+              // Header tag started '<?xml
+              idx++;
+              state = psTagHeader;
+            } else {
+              state = psTagStart;
+            }
+            token.reset();
+          } else {
+            skipTo(NULL, '<');
+          }
+          break;
+        case psCommentStart : // Make sure we hit '--'
+          if ((c == '-') && (peek()=='-')) {
+            idx++;
+            state = psCommentConsume;
+          } else if ((c == 'D') && (peek()=='O')) {
+            state = psDocType;
+          } else {
+#ifdef _DEBUG
+            printf("WARN: Illegal start of tag, expected start of comment ('<!--') but found '<!%c'\n", c);
+#endif
+            // TODO: If strict, abort here!
+            idx -= 2;   // rewind '-' and '!'
+            state = psTagStart;
+          }
+          break;
+        case psCommentConsume:  // parse until -->
+          if ((c=='-') && (peek()=='>')) {
+            if (commentDash) {
+              idx++;
+              state = (skipDepth > 0)?psSkipContent:psConsume;
+            }
+          } else if (c=='-') {
+            commentDash = true;  // Store this in order to track -->
+          } else {
+            skipTo(NULL, '-');
+          }
+          break;
+        case psTagHeader : // <? 
+          if (XmlScan::isSpace(c)) {
+            // drop them
+            sink.onInstructionStart(trimmedToken());
+            token.reset();
+            state = psTagAttributeName;
+          } else {
+            token.add(idx-1);
+            skipName();
+          }				
+          break;
+        case psTagStart :	// from psConsume when finding: '<'          
+          if (XmlScan::isSpace(c)) {					          
+            sink.onTagStart(trimmedToken());
+            token.reset();
+            state = psTagAttributeName;
+          } else if (c=='/' && peek()=='>') {   // catch tags like '<tag/>'
+            idx++; // consume '>'
+            StringView name = trimmedToken();
+            sink.onTagStart(name);
+            sink.onTagCommit();
+            sink.onTagEnd(name);
+            token.reset();
+            state = psConsume;
+          } else if (c=='>') {
+            sink.onTagStart(trimmedToken());
+            token.reset();
+            state = beginContent(sink.onTagCommit());
+          } else {
+            token.add(idx-1);
+            skipName();
+          }				
+          break;
+        case psEndTagStart : // from psConsume when finding: </
+          if (XmlScan::isSpace(c)) {
+            // drop them
+          } else if (c=='>') {
+            sink.onTagEnd(trimmedToken());
+            token.reset();
+            state = psConsume;
+          } else {
+            token.add(idx-1);
+            skipName();
+          }				
+          break;
+        case psTagAttributeName : // from psTagStart when finding white-space, from psTagHeader (<?) when finding white-space
+          if (XmlScan::isSpace(c)) continue;
+          if ((c == '=') && (peek() == '"')) {
+            idx++; // consume "
+            attrName = token;
+            token.reset();
+            state = psTagAttributeValue;
+          } else if ((c == '=') && (peek() == '#')) {
+            idx++; // consume #
+            sink.onAttribute(trimmedToken(), StringView("#"));
+            token.reset();
+          } else if (c=='>') {	// End of tag
+            token.reset();
+            state = beginContent(sink.onTagCommit());
+          } else if (((c=='/') || (c=='?')) && (peek()=='>')) {
+            idx++;
+            sink.onTagCommit();
+            sink.onTagEnd(trimmedToken());
+            token.reset();
+            state = psConsume;
+          } else { 
+            token.add(idx-1);
+            skipName();
+          }
+          break;
+        case psTagAttributeValue : // from psTagAttributeName after '='
+          if (c=='"') {
+            sink.onAttribute(StringUtilStatic::trim(attrName.view(source.pData)), token.view(source.pData));
+            token.reset();
+            state = psTagAttributeName;
+          } else {
+            token.add(idx-1);
+            skipTo(&token, '"');
+          }
+          break;
+        case psTagContent:
+          if (c == '<') {	// can't use 'peekNext' since we might have >< which is legal
+            sink.onContent(trimmedToken());
+            token.reset();
+            state = psConsume;
+            idx--;	// rewind so we will see tag start next time
+          } else {
+            token.add(idx-1);
+            skipTo(&token, '<');
+          }
+          break;
+        case psDocType:
+          if (c == '>') {
+            token.reset();
+            state = psConsume;
+          } else {
+            skipTo(NULL, '>');
+          }
+          break;
+        case psSkipContent :  // inside a skipped subtree, only the nesting is tracked
+          if (c == '<') {
+            int next = peek();
+            if (next == '/') {
+              idx++;
+              if (skipDepth == 1) {
+                // the end tag of the skipped tag is handled as usual
+                skipDepth = 0;
+                token.reset();
+                state = psEndTagStart;
+              } else {
+                skipDepth--;
+                state = psSkipEndTag;
+              }
+            } else if ((next == '!') || (next == '?')) {
+              idx++;
+              state = psSkipMarkup;
+            } else {
+              skipSlash = false;
+              skipQuote = false;
+              state = psSkipTag;
+            }
+          } else {
+            skipTo(NULL, '<');
+          }
+          break;
+        case psSkipTag :  // start tag within a skipped subtree, '<tag/>' doesn't nest
+          if (skipQuote) {
+            if (c == '"') skipQuote = false; else skipTo(NULL, '"');
+          } else if (c == '"') {
+            skipQuote = true;
+          } else if (c == '>') {
+            if (!skipSlash) skipDepth++;
+            state = psSkipContent;
+          } else {
+            skipSlash = (c == '/');
+          }
+          break;
+        case psSkipEndTag :
+          if (c == '>') {
+            state = psSkipContent;
+          } else {
+            skipTo(NULL, '>');
+          }
+          break;
+        case psSkipMarkup : // after '<!' or '<?'
+          if ((c == '-') && (peek() == '-')) {
+            idx++;
+            commentDash = false;
+            state = psCommentConsume;
+          } else if (c == '>') {
+            state = psSkipContent;
+          } else {
+            state = psSkipEndTag;
+          }
+          break;
+        } // switch
+      } // while (!eof)
+    } // parse
+
     // -------------- Main stuff ends here, rest is just for performance testing of various calling techniques
 
     // 
@@ -333,7 +1795,7 @@ namespace gnilk {
     class ParseStateFunc : public Parser{
       /////////
     public:
-      ParseStateFunc(std::string _data, IParseEvents *pEventHandler);
+      ParseStateFunc(std::string _data, IParseEvents *pEventHandler, int flags = pfNone);
 
       virtual void parseData();       
       __inline void stateConsume(char c);
@@ -447,9 +1909,9 @@ namespace gnilk {
       StateTagContent stateTagContent;
       StateTagDTDDocType stateTagDTDDocType;
     public:
-      ParseStateClasses(std::string _data, IParseEvents *pEventHandler);
+      ParseStateClasses(std::string _data, IParseEvents *pEventHandler, int flags = pfNone);
       virtual void changeState(kParseState newState);
-      virtual void initialize(std::string _data, IParseEvents *pEventHandler);
+      virtual void initialize(std::string _data, IParseEvents *pEventHandler, int flags = pfNone);
       virtual void parseData();
     };
   }